@@ -0,0 +1,617 @@
+/**
+ * bench.cpp is a workload generator for RBtree. It builds a tree, runs a synthetic mix of searches, inserts and deletes
+ * against it from several threads, the same way the search and modify threads of rbtree.cpp share it, and reports the
+ * throughput and the latency percentiles of each kind of operation. A sweep runs the same workload over an increasing
+ * number of threads to show how it scales. The memory mode instead compares the bytes per key of RBtree, of a tree
+ * allocating every node with new, and of CompactRBtree, and the search time of the two trees.
+ **/
+
+#include "rbtree.h"
+#include "sharded_rbtree.h"
+#include "frozen_index.h"
+#include "compact_rbtree.h"
+#include <pthread.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+/**
+ * Key distributions the workload can draw from.
+ * */
+enum Distribution {
+    UNIFORM,
+    ZIPF,
+    SEQUENTIAL
+};
+
+/**
+ * The kinds of operation timed by the benchmark.
+ * */
+enum BenchOp {
+    BENCH_SEARCH,
+    BENCH_INSERT,
+    BENCH_DELETE,
+    NUM_BENCH_OPS
+};
+
+const char *bench_op_names[NUM_BENCH_OPS] = {"search", "insert", "delete"};
+
+/**
+ * The Workload struct holds every setting of one benchmark run.
+ * */
+struct Workload {
+    //number of keys in the tree before the run
+    long tree_size;
+    //keys are drawn from 0 to universe - 1
+    long universe;
+    //total number of operations, split evenly between the threads
+    long ops;
+    //percentages of inserts and deletes; the rest are searches
+    int insert_pct;
+    int delete_pct;
+    Distribution dist;
+    //skew of the Zipfian distribution
+    double theta;
+    int threads;
+    //searches run without the tree lock, as with rbtree -o
+    bool optimistic;
+    //number of key range shards, as with rbtree -k; 1 for a single tree
+    int shards;
+    //searches use a frozen index of the tree, as with rbtree -f
+    bool frozen;
+    //searches are collected and run this many at a time with search_batch, as with rbtree -b
+    int batch;
+    //how the tree lock picks between waiting searches and modifications, as with "Scheduling:" in rbtree's input
+    RWPolicy policy;
+    unsigned long seed;
+};
+
+/**
+ * ZipfGenerator draws ranks from 0 to n - 1 so that rank i comes up in proportion to 1 / (i + 1)^theta, using the
+ * method of Gray et al., "Quickly Generating Billion-Record Synthetic Databases". The ranks are scattered over the key
+ * space so the popular keys do not all sit in one corner of the tree.
+ * */
+class ZipfGenerator {
+    public:
+    ZipfGenerator(long n, double theta) : n(n), theta(theta) {
+        zetan = 0;
+        for (long i=1; i<=n; i++) {
+            zetan += 1.0 / pow((double) i, theta);
+        }
+        double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+    /**
+     * next returns a key for the uniform number u between 0 and 1.
+     * */
+    long next(double u) const {
+        double uz = u * zetan;
+        long rank;
+        if (uz < 1.0) {
+            rank = 0;
+        } else if (uz < 1.0 + pow(0.5, theta)) {
+            rank = 1;
+        } else {
+            rank = (long) (n * pow(eta * u - eta + 1.0, alpha));
+        }
+        if (rank >= n) {
+            rank = n - 1;
+        }
+        //2654435761 is a prime larger than any universe used here, so this maps ranks to keys one to one
+        return (long) ((unsigned long) rank * 2654435761UL % (unsigned long) n);
+    }
+
+    private:
+    long n;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+/**
+ * The WorkerState struct is what one benchmark thread needs: its share of the workload and its latency samples.
+ * */
+struct WorkerState {
+    const Workload *w;
+    const ZipfGenerator *zipf;
+    int id;
+    //latency of every operation in nanoseconds, one vector per BenchOp
+    vector<long> latency[NUM_BENCH_OPS];
+    //searches that found their key; printing it keeps the compiler from dropping the searches
+    long hits;
+    //when the thread started and finished its operations
+    chrono::steady_clock::time_point begin, finish;
+};
+
+RBtree<int> *bench_tree;
+ShardedRBtree<int> *bench_sharded;
+FrozenView<int> *bench_frozen;
+RWlock bench_lock;
+pthread_barrier_t bench_barrier;
+
+/**
+ * run_batch runs the searches for keys together with search_batch, records the time each one took on average and
+ * empties keys. found must have room for a result per key.
+ * */
+void run_batch(WorkerState *s, vector<int> &keys, bool *found) {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    bench_lock.lock_shared();
+    bench_tree->search_batch(keys.data(), keys.size(), found);
+    bench_lock.unlock_shared();
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    long each = chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count() / keys.size();
+    for (size_t i=0; i<keys.size(); i++) {
+        s->hits += found[i];
+        s->latency[BENCH_SEARCH].push_back(each);
+    }
+    keys.clear();
+}
+
+/**
+ * bench_worker runs one thread's share of the operations against bench_tree and records how long each one took.
+ * */
+void *(bench_worker)(void *arg) {
+    WorkerState *s = (WorkerState *) arg;
+    const Workload &w = *s->w;
+    mt19937_64 rng(w.seed + s->id);
+    uniform_real_distribution<double> real(0.0, 1.0);
+    uniform_int_distribution<long> key_dist(0, w.universe - 1);
+    uniform_int_distribution<int> pct(0, 99);
+    long count = w.ops / w.threads + (s->id < w.ops % w.threads ? 1 : 0);
+    for (int i=0; i<NUM_BENCH_OPS; i++) {
+        s->latency[i].reserve(count);
+    }
+    s->hits = 0;
+    //searches waiting to be run as a batch
+    vector<int> batch_keys;
+    bool *found = new bool[w.batch];
+    pthread_barrier_wait(&bench_barrier);
+    s->begin = chrono::steady_clock::now();
+    for (long i=0; i<count; i++) {
+        int p = pct(rng);
+        BenchOp op = p < w.insert_pct ? BENCH_INSERT : p < w.insert_pct + w.delete_pct ? BENCH_DELETE : BENCH_SEARCH;
+        long key;
+        if (w.dist == ZIPF) {
+            key = s->zipf->next(real(rng));
+        } else if (w.dist == SEQUENTIAL) {
+            //the threads take turns walking the key space in order
+            key = (i * w.threads + s->id) % w.universe;
+        } else {
+            key = key_dist(rng);
+        }
+        if (w.batch > 1 && op == BENCH_SEARCH) {
+            batch_keys.push_back(key);
+            if ((int) batch_keys.size() == w.batch || i == count - 1) {
+                run_batch(s, batch_keys, found);
+            }
+            continue;
+        }
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (bench_sharded != NULL) {
+            //the shards lock themselves
+            if (op == BENCH_SEARCH && w.optimistic) {
+                s->hits += bench_sharded->search_optimistic(key);
+            } else if (op == BENCH_SEARCH) {
+                s->hits += bench_sharded->search(key);
+            } else if (op == BENCH_INSERT) {
+                bench_sharded->insert(key);
+            } else {
+                bench_sharded->delete_node(key);
+            }
+        } else if (op == BENCH_SEARCH) {
+            if (w.optimistic) {
+                s->hits += bench_tree->search_optimistic(key);
+            } else {
+                bench_lock.lock_shared();
+                if (bench_frozen != NULL) {
+                    s->hits += bench_frozen->search(bench_tree, key, true);
+                } else {
+                    s->hits += bench_tree->search(key);
+                }
+                bench_lock.unlock_shared();
+            }
+        } else {
+            bench_lock.lock();
+            if (op == BENCH_INSERT) {
+                bench_tree->insert(key);
+            } else {
+                bench_tree->delete_node(key);
+            }
+            bench_lock.unlock();
+        }
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        s->latency[op].push_back(chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count());
+    }
+    if (!batch_keys.empty()) {
+        run_batch(s, batch_keys, found);
+    }
+    s->finish = chrono::steady_clock::now();
+    delete[] found;
+    return NULL;
+}
+
+/**
+ * percentile returns the latency below which the fraction p of the sorted samples fall.
+ * */
+long percentile(const vector<long> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = (size_t) (p * sorted.size());
+    if (i >= sorted.size()) {
+        i = sorted.size() - 1;
+    }
+    return sorted[i];
+}
+
+/**
+ * run_workload builds a fresh tree holding every other key of the universe up to tree_size keys, runs the workload w
+ * against it and prints the throughput and the p50/p99/p999 latency of each kind of operation.
+ * Returns 1 if the threads cannot be started.
+ * */
+int run_workload(const Workload &w, const ZipfGenerator *zipf) {
+    vector<int> keys;
+    keys.reserve(w.tree_size);
+    long step = w.universe / w.tree_size > 0 ? w.universe / w.tree_size : 1;
+    for (long i=0; i<w.tree_size; i++) {
+        keys.push_back(i * step);
+    }
+    bench_tree = create_tree_sorted(keys);
+    keys.clear();
+    keys.shrink_to_fit();
+    bench_sharded = NULL;
+    bench_frozen = NULL;
+    bench_lock.set_policy(w.policy);
+    if (w.frozen) {
+        //built before the clock starts
+        bench_frozen = new FrozenView<int>();
+        bench_frozen->search(bench_tree, 0, true);
+    }
+    if (w.shards > 1) {
+        bench_sharded = new ShardedRBtree<int>(bench_tree, w.shards);
+        for (size_t i=0; i<bench_sharded->shards.size(); i++) {
+            bench_sharded->shards[i]->lock.set_policy(w.policy);
+        }
+        delete bench_tree;
+        bench_tree = NULL;
+    }
+
+    vector<WorkerState> states(w.threads);
+    vector<pthread_t> threads(w.threads);
+    pthread_barrier_init(&bench_barrier, NULL, w.threads + 1);
+    for (int i=0; i<w.threads; i++) {
+        states[i].w = &w;
+        states[i].zipf = zipf;
+        states[i].id = i;
+        if (pthread_create(&threads[i], NULL, bench_worker, &states[i])) {
+            printf("Error creating thread\n");
+            return 1;
+        }
+    }
+    //every thread has reserved its sample space before any of them starts
+    pthread_barrier_wait(&bench_barrier);
+    for (int i=0; i<w.threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    //the run lasts from the first thread starting to the last one finishing
+    chrono::steady_clock::time_point start = states[0].begin, complete = states[0].finish;
+    for (int i=1; i<w.threads; i++) {
+        start = min(start, states[i].begin);
+        complete = max(complete, states[i].finish);
+    }
+    double seconds = chrono::duration<double>(complete - start).count();
+    pthread_barrier_destroy(&bench_barrier);
+
+    printf("threads %d  ops %ld  time %.3f s  throughput %.0f ops/sec  final size %d\n",
+           w.threads, w.ops, seconds, w.ops / seconds, bench_sharded != NULL ? bench_sharded->size() : bench_tree->size());
+    long hits = 0;
+    for (int i=0; i<w.threads; i++) {
+        hits += states[i].hits;
+    }
+    for (int op=0; op<NUM_BENCH_OPS; op++) {
+        vector<long> all;
+        for (int i=0; i<w.threads; i++) {
+            all.insert(all.end(), states[i].latency[op].begin(), states[i].latency[op].end());
+        }
+        if (all.empty()) {
+            continue;
+        }
+        sort(all.begin(), all.end());
+        printf("    %-7s count %-10zu %10.0f ops/sec  p50 %6ld ns  p99 %7ld ns  p999 %8ld ns\n", bench_op_names[op],
+               all.size(), all.size() / seconds, percentile(all, 0.50), percentile(all, 0.99), percentile(all, 0.999));
+        if (op == BENCH_SEARCH) {
+            printf("            %ld found (%.1f%%)\n", hits, 100.0 * hits / all.size());
+        }
+    }
+    fflush(stdout);
+    delete bench_tree;
+    delete bench_sharded;
+    delete bench_frozen;
+    return 0;
+}
+
+/**
+ * heap_bytes returns the number of bytes currently allocated on the heap, including large blocks that were mapped
+ * on their own.
+ * */
+size_t heap_bytes() {
+    struct mallinfo2 m = mallinfo2();
+    return m.uordblks + m.hblkhd;
+}
+
+/**
+ * print_memory prints the bytes per key of a structure that took bytes for tree_size keys, and the time of one of its
+ * searches unless search_ns is negative.
+ * */
+void print_memory(const char *name, size_t bytes, long tree_size, double search_ns) {
+    printf("    %-28s %6.1f bytes/key  %9.1f MB", name, (double) bytes / tree_size, bytes / 1e6);
+    if (search_ns >= 0) {
+        printf("  %7.1f ns/search", search_ns);
+    }
+    printf("\n");
+}
+
+/**
+ * fits returns true if bytes more can be allocated without running out of physical memory, and otherwise prints
+ * that the structure name is skipped.
+ * */
+bool fits(const char *name, double bytes) {
+    double avail = (double) sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (bytes < avail) {
+        return true;
+    }
+    printf("    %-28s skipped: needs about %.0f MB, %.0f MB free\n", name, bytes / 1e6, avail / 1e6);
+    return false;
+}
+
+/**
+ * memory_key returns the i-th of the n keys the memory mode inserts: every step-th key of the universe, in a scattered
+ * order so the tree is not built from a sorted run, without keeping the keys in memory.
+ * */
+int memory_key(long i, long n, long step) {
+    //2654435761 is a prime larger than any tree size used here, so multiplying by it permutes 0 to n - 1
+    return (int) ((unsigned long) i * 2654435761UL % n * step);
+}
+
+//the number of keys the last timed searches found, stored so the searches are not optimized away
+volatile long searches_found;
+
+/**
+ * time_searches returns the average time in nanoseconds of searching t for each key of probes.
+ * */
+template <class T>
+double time_searches(T *t, const vector<int> &probes) {
+    long found = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t i=0; i<probes.size(); i++) {
+        found += t->search(probes[i]);
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    searches_found = found;
+    return probes.empty() ? 0 : ns / probes.size();
+}
+
+/**
+ * measure_memory inserts the same tree_size keys, in a scattered order, into an RBtree, into nodes allocated one by
+ * one with new, and into a CompactRBtree, and prints the heap bytes each took per key. It then times w.ops searches
+ * for keys drawn from the whole universe in each tree, so the two layouts can be compared for cache behaviour as
+ * well. A structure that would not fit in the free physical memory is skipped.
+ * */
+void measure_memory(const Workload &w) {
+    long n = w.tree_size;
+    long step = w.universe / n > 0 ? w.universe / n : 1;
+    vector<int> probes;
+    probes.reserve(w.ops);
+    mt19937_64 rng(w.seed);
+    uniform_int_distribution<long> key_dist(0, w.universe - 1);
+    for (long i=0; i<w.ops; i++) {
+        probes.push_back(key_dist(rng));
+    }
+    if (fits("RBtree with its node pool:", 1.1 * sizeof(Node<int>) * n)) {
+        size_t before = heap_bytes();
+        RBtree<int> *t = new RBtree<int>();
+        for (long i=0; i<n; i++) {
+            t->insert(memory_key(i, n, step));
+        }
+        size_t bytes = heap_bytes() - before;
+        print_memory("RBtree with its node pool:", bytes, n, time_searches(t, probes));
+        delete t;
+    }
+    //what every node cost when each one was allocated on its own
+    if (fits("new Node() per key:", 1.1 * (sizeof(Node<int>) + 16) * n)) {
+        vector<Node<int> *> nodes;
+        nodes.reserve(n);
+        size_t before = heap_bytes();
+        for (long i=0; i<n; i++) {
+            nodes.push_back(new Node<int>());
+        }
+        print_memory("new Node() per key:", heap_bytes() - before, n, -1);
+        for (size_t i=0; i<nodes.size(); i++) {
+            delete nodes[i];
+        }
+    }
+    //the node array doubles as it grows, so its last growth holds the old array and one twice as large
+    double room = 1;
+    while (room < n + 1) {
+        room *= 2;
+    }
+    if (fits("CompactRBtree:", 1.5 * room * sizeof(CompactNode))) {
+        size_t before = heap_bytes();
+        CompactRBtree *c = new CompactRBtree();
+        for (long i=0; i<n; i++) {
+            c->insert(memory_key(i, n, step));
+        }
+        size_t bytes = heap_bytes() - before;
+        print_memory("CompactRBtree:", bytes, n, time_searches(c, probes));
+        delete c;
+    }
+}
+
+/**
+ * usage prints the options of the benchmark.
+ * */
+void usage(const char *name) {
+    printf("Usage: %s [-n tree size] [-u key universe] [-m ops] [-i insert %%] [-d delete %%]\n"
+           "          [-k uniform|zipf|sequential] [-z theta] [-t threads | -w max threads] [-o | -f | -b batch] [-p shards]\n"
+           "          [-s reader-preferring|writer-preferring|phase-fair] [-r seed] [-M]\n", name);
+}
+
+int main(int argc, char **argv) {
+    Workload w;
+    w.tree_size = 1000000;
+    w.universe = 0;
+    w.ops = 1000000;
+    w.insert_pct = 5;
+    w.delete_pct = 5;
+    w.dist = UNIFORM;
+    w.theta = 0.99;
+    w.threads = 1;
+    w.optimistic = false;
+    w.shards = 1;
+    w.frozen = false;
+    w.batch = 1;
+    w.policy = READER_PREFERRING;
+    w.seed = 1;
+    int sweep = 0;
+    bool memory = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u:m:i:d:k:z:t:w:ofb:p:s:r:M")) != -1) {
+        switch (opt) {
+            case 'n':
+                w.tree_size = atol(optarg);
+                break;
+            case 'u':
+                w.universe = atol(optarg);
+                break;
+            case 'm':
+                w.ops = atol(optarg);
+                break;
+            case 'i':
+                w.insert_pct = atoi(optarg);
+                break;
+            case 'd':
+                w.delete_pct = atoi(optarg);
+                break;
+            case 'k':
+                if (strcmp(optarg, "uniform") == 0) {
+                    w.dist = UNIFORM;
+                } else if (strcmp(optarg, "zipf") == 0) {
+                    w.dist = ZIPF;
+                } else if (strcmp(optarg, "sequential") == 0) {
+                    w.dist = SEQUENTIAL;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'z':
+                w.theta = atof(optarg);
+                break;
+            case 't':
+                w.threads = atoi(optarg);
+                break;
+            case 'w':
+                sweep = atoi(optarg);
+                break;
+            case 'o':
+                w.optimistic = true;
+                break;
+            case 'f':
+                w.frozen = true;
+                break;
+            case 'b':
+                w.batch = atoi(optarg);
+                break;
+            case 'p':
+                w.shards = atoi(optarg);
+                break;
+            case 's':
+                if (strcmp(optarg, "reader-preferring") == 0) {
+                    w.policy = READER_PREFERRING;
+                } else if (strcmp(optarg, "writer-preferring") == 0) {
+                    w.policy = WRITER_PREFERRING;
+                } else if (strcmp(optarg, "phase-fair") == 0) {
+                    w.policy = PHASE_FAIR;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                w.seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'M':
+                memory = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    //by default half of the keys searched for are in the tree
+    if (w.universe <= 0) {
+        w.universe = 2 * w.tree_size;
+    }
+    if (w.tree_size < 1 || w.tree_size > w.universe || w.universe > INT32_MAX || w.ops < 0 || w.threads < 1
+        || w.insert_pct < 0 || w.delete_pct < 0 || w.insert_pct + w.delete_pct > 100 || w.theta <= 0 || w.theta == 1
+        || (w.frozen && (w.insert_pct + w.delete_pct > 0 || w.optimistic || w.shards > 1))
+        || w.batch < 1 || (w.batch > 1 && (w.optimistic || w.frozen || w.shards > 1))) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (memory) {
+        printf("memory of %ld keys\n", w.tree_size);
+        measure_memory(w);
+        return 0;
+    }
+    const char *dist_names[] = {"uniform", "zipf", "sequential"};
+    printf("tree size %ld  universe %ld  mix %d%% search %d%% insert %d%% delete  keys %s",
+           w.tree_size, w.universe, 100 - w.insert_pct - w.delete_pct, w.insert_pct, w.delete_pct, dist_names[w.dist]);
+    if (w.dist == ZIPF) {
+        printf(" (theta %.2f)", w.theta);
+    }
+    if (w.shards > 1) {
+        printf("  %d shards", w.shards);
+    }
+    if (w.batch > 1) {
+        printf("  searches in batches of %d", w.batch);
+    }
+    if (w.policy != READER_PREFERRING) {
+        printf("  %s lock", w.policy == WRITER_PREFERRING ? "writer-preferring" : "phase-fair");
+    }
+    printf("%s%s\n", w.optimistic ? "  optimistic searches" : "", w.frozen ? "  frozen index" : "");
+    ZipfGenerator *zipf = NULL;
+    if (w.dist == ZIPF) {
+        zipf = new ZipfGenerator(w.universe, w.theta);
+    }
+    int status = 0;
+    if (sweep > 0) {
+        //1, 2, 4, ... threads and finally sweep itself
+        vector<int> counts;
+        for (int t=1; t<sweep; t *= 2) {
+            counts.push_back(t);
+        }
+        counts.push_back(sweep);
+        for (size_t i=0; i<counts.size() && status == 0; i++) {
+            w.threads = counts[i];
+            status = run_workload(w, zipf);
+        }
+    } else {
+        status = run_workload(w, zipf);
+    }
+    delete zipf;
+    return status;
+}
@@ -0,0 +1,352 @@
+/**
+ * compact_rbtree.cpp contains the implementations of the functions of CompactRBtree. The algorithms are the
+ * same as the ones of RBtree, working on node indices instead of node pointers.
+ **/
+
+#include "compact_rbtree.h"
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+/**
+ * search returns true if the input integer is present in the tree
+ * and false if it is not.
+ * */
+bool CompactRBtree::search(int num) const {
+    uint32_t tmp = root;
+    while (tmp != nil) {
+        const CompactNode &n = nodes[tmp];
+        if (n.key == num) {
+            return true;
+        //if node's key is greater, check it's left children
+        } else if (n.key > num) {
+            tmp = n.left;
+        //if node's key is less than, check it's right children
+        } else {
+            tmp = n.right;
+        }
+    }
+    return false;
+}
+
+/**
+ * allocate returns the index of a new red node holding num, reusing a deleted node when there is one.
+ * */
+uint32_t CompactRBtree::allocate(int num) {
+    uint32_t n = free_list;
+    if (n != nil) {
+        free_list = nodes[n].left;
+    } else {
+        n = nodes.size();
+        nodes.push_back(CompactNode());
+    }
+    nodes[n].key = num;
+    nodes[n].left = nil;
+    nodes[n].right = nil;
+    nodes[n].parent_color = 1;
+    return n;
+}
+
+/**
+ * get_minimum returns the index of the node with the smallest key value in the subtree starting at node n.
+ * */
+uint32_t CompactRBtree::get_minimum(uint32_t n) const {
+    while (nodes[n].left != nil) {
+        n = nodes[n].left;
+    }
+    return n;
+}
+
+/**
+ * delete_node removes the node with the inputted key value from the tree
+ * if it exists. It calls helper functions to maintain the red black characteristics.
+ * */
+void CompactRBtree::delete_node(int num) {
+    uint32_t n = root;
+    uint32_t x;
+    //find the node with this integer value
+    while (n != nil && nodes[n].key != num) {
+        if (nodes[n].key > num) {
+            n = nodes[n].left;
+        } else {
+            n = nodes[n].right;
+        }
+    }
+    //nothing to delete
+    if (n == nil) {
+        return;
+    }
+    uint32_t tmp = n;
+    bool orig_color = red(tmp);
+
+    if (nodes[n].left == nil) {
+        x = nodes[n].right;
+        transplant(n, nodes[n].right);
+    } else if (nodes[n].right == nil) {
+        x = nodes[n].left;
+        transplant(n, nodes[n].left);
+    } else {
+        tmp = get_minimum(nodes[n].right);
+        orig_color = red(tmp);
+        x = nodes[tmp].right;
+        if (parent(tmp) == n) {
+            set_parent(x, tmp);
+        } else {
+            transplant(tmp, nodes[tmp].right);
+            nodes[tmp].right = nodes[n].right;
+            set_parent(nodes[tmp].right, tmp);
+        }
+        transplant(n, tmp);
+        nodes[tmp].left = nodes[n].left;
+        set_parent(nodes[tmp].left, tmp);
+        set_red(tmp, red(n));
+    }
+    if (!orig_color) {
+        delete_node_fixup(x);
+    }
+    nodes[n].left = free_list;
+    free_list = n;
+    count--;
+}
+
+/**
+ * insert inserts a new node with the given key value into the tree. It calls helper
+ * functions to maintain the red black characteristics.
+ * */
+void CompactRBtree::insert(int num) {
+    uint32_t n = allocate(num);
+    uint32_t x = root;
+    uint32_t y = nil;
+    //figure out where n should be placed based on normal BST
+    while (x != nil) {
+        y = x;
+        if (num < nodes[x].key) {
+            x = nodes[x].left;
+        } else {
+            x = nodes[x].right;
+        }
+    }
+    set_parent(n, y);
+    //is n root, right child, or left child?
+    if (y == nil) {
+        root = n;
+    } else if (num < nodes[y].key) {
+        nodes[y].left = n;
+    } else {
+        nodes[y].right = n;
+    }
+    count++;
+    //fix any rb properties that were violated during insertion
+    insert_fixup(n);
+}
+
+/**
+ * transplant is a helper method for deletions that changes the relationships of the nodes during deletion.
+ * */
+void CompactRBtree::transplant(uint32_t n1, uint32_t n2) {
+    uint32_t p = parent(n1);
+    if (p == nil) {
+        root = n2;
+    } else if (n1 == nodes[p].left) {
+        nodes[p].left = n2;
+    } else {
+        nodes[p].right = n2;
+    }
+    set_parent(n2, p);
+}
+
+/**
+ * delete_node_fixup is a helper method that ensures the properties of the red black tree are maintained during deletion.
+ * */
+void CompactRBtree::delete_node_fixup(uint32_t n) {
+    uint32_t tmp;
+    while (n != root && !red(n)) {
+        uint32_t p = parent(n);
+        if (n == nodes[p].left) {
+            tmp = nodes[p].right;
+            if (red(tmp)) {
+                set_red(tmp, false);
+                set_red(p, true);
+                left_rotate(p);
+                tmp = nodes[parent(n)].right;
+            }
+            if (!red(nodes[tmp].left) && !red(nodes[tmp].right)) {
+                set_red(tmp, true);
+                n = parent(n);
+            } else {
+                if (!red(nodes[tmp].right)) {
+                    set_red(nodes[tmp].left, false);
+                    set_red(tmp, true);
+                    right_rotate(tmp);
+                    tmp = nodes[parent(n)].right;
+                }
+                set_red(tmp, red(parent(n)));
+                set_red(parent(n), false);
+                set_red(nodes[tmp].right, false);
+                left_rotate(parent(n));
+                n = root;
+            }
+        } else {
+            tmp = nodes[p].left;
+            if (red(tmp)) {
+                set_red(tmp, false);
+                set_red(p, true);
+                right_rotate(p);
+                tmp = nodes[parent(n)].left;
+            }
+            if (!red(nodes[tmp].right) && !red(nodes[tmp].left)) {
+                set_red(tmp, true);
+                n = parent(n);
+            } else {
+                if (!red(nodes[tmp].left)) {
+                    set_red(nodes[tmp].right, false);
+                    set_red(tmp, true);
+                    left_rotate(tmp);
+                    tmp = nodes[parent(n)].left;
+                }
+                set_red(tmp, red(parent(n)));
+                set_red(parent(n), false);
+                set_red(nodes[tmp].left, false);
+                right_rotate(parent(n));
+                n = root;
+            }
+        }
+    }
+    set_red(n, false);
+}
+
+/**
+ * insert_fixup is a helper method that ensures the properties of the red black tree are maintained during insertion.
+ * */
+void CompactRBtree::insert_fixup(uint32_t n) {
+    uint32_t tmp;
+    while (red(parent(n))) {
+        uint32_t p = parent(n);
+        uint32_t g = parent(p);
+        //n's parent is a left child
+        if (p == nodes[g].left) {
+            tmp = nodes[g].right;
+            //case 1: the uncle is red
+            if (red(tmp)) {
+                set_red(p, false);
+                set_red(tmp, false);
+                set_red(g, true);
+                n = g;
+            } else {
+                //case 2: n is a right child
+                if (n == nodes[p].right) {
+                    n = p;
+                    left_rotate(n);
+                }
+                //case 3: red node with a red child
+                set_red(parent(n), false);
+                set_red(parent(parent(n)), true);
+                right_rotate(parent(parent(n)));
+            }
+        //n's parent is a right child
+        } else {
+            tmp = nodes[g].left;
+            //case 1: the uncle is red
+            if (red(tmp)) {
+                set_red(p, false);
+                set_red(tmp, false);
+                set_red(g, true);
+                n = g;
+            } else {
+                //case 2: n is a left child
+                if (n == nodes[p].left) {
+                    n = p;
+                    right_rotate(n);
+                }
+                //case 3: red node with a red child
+                set_red(parent(n), false);
+                set_red(parent(parent(n)), true);
+                left_rotate(parent(parent(n)));
+            }
+        }
+    }
+    //make the root black
+    set_red(root, false);
+}
+
+/**
+ * left_rotate performs a left rotation on the node n and its children
+ * */
+void CompactRBtree::left_rotate(uint32_t n) {
+    uint32_t tmp = nodes[n].right;
+    nodes[n].right = nodes[tmp].left;
+    if (nodes[tmp].left != nil) {
+        set_parent(nodes[tmp].left, n);
+    }
+    uint32_t p = parent(n);
+    set_parent(tmp, p);
+    if (p == nil) {
+        root = tmp;
+    } else if (n == nodes[p].left) {
+        nodes[p].left = tmp;
+    } else {
+        nodes[p].right = tmp;
+    }
+    nodes[tmp].left = n;
+    set_parent(n, tmp);
+}
+
+/**
+ * right_rotate performs a right rotation on the node n and its children
+ * */
+void CompactRBtree::right_rotate(uint32_t n) {
+    uint32_t tmp = nodes[n].left;
+    nodes[n].left = nodes[tmp].right;
+    if (nodes[tmp].right != nil) {
+        set_parent(nodes[tmp].right, n);
+    }
+    uint32_t p = parent(n);
+    set_parent(tmp, p);
+    if (p == nil) {
+        root = tmp;
+    } else if (n == nodes[p].right) {
+        nodes[p].right = tmp;
+    } else {
+        nodes[p].left = tmp;
+    }
+    nodes[tmp].right = n;
+    set_parent(n, tmp);
+}
+
+/**
+ * preorder_print prints the tree in preorder from the input node n, in the same format as RBtree::preorder_print.
+ * */
+void CompactRBtree::preorder_print(uint32_t n, ofstream& out) const {
+    if (n == nil) {
+        out << ",f";
+        return;
+    }
+    if (n != root) {
+        out << ",";
+    }
+    out << nodes[n].key << (red(n) ? 'r' : 'b');
+    preorder_print(nodes[n].left, out);
+    preorder_print(nodes[n].right, out);
+}
+
+/**
+ * reserve makes room for n keys so that loading them does not grow the node array step by step.
+ * */
+void CompactRBtree::reserve(size_t n) {
+    nodes.reserve(n + 1);
+}
+
+/**
+ * size returns the number of keys in the tree.
+ * */
+size_t CompactRBtree::size() const {
+    return count;
+}
+
+/**
+ * memory_usage returns the number of bytes held by the node array.
+ * */
+size_t CompactRBtree::memory_usage() const {
+    return nodes.capacity() * sizeof(CompactNode);
+}
@@ -0,0 +1,197 @@
+/**
+ * frozen_index.h defines FrozenIndex, an immutable copy of the keys of an RBtree laid out for fast searching, and
+ * FrozenView, which keeps a FrozenIndex of a tree up to date lazily for the search threads.
+ *
+ * The keys are stored as a static B-tree of blocks of FROZEN_BLOCK keys, one cache line for int keys, with the
+ * children of block k at k * (FROZEN_BLOCK + 1) + 1 and up. A search reads one block per level, log17(n) levels instead
+ * of the log2(n) scattered nodes of the tree, and finds its place in a block without branching; for int keys the block
+ * is compared with SSE2.
+ **/
+#include "rbtree.h"
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef FROZEN_INDEX_H_
+#define FROZEN_INDEX_H_
+
+using namespace std;
+
+/**
+ * FROZEN_BLOCK is the number of keys in a block of a FrozenIndex.
+ * */
+#define FROZEN_BLOCK 16
+
+/**
+ * The FrozenIndex class holds the keys of a tree, as they were at one version of the tree, in a static B-tree.
+ * */
+template <class Key, class Compare = less<Key> >
+class FrozenIndex {
+    public:
+    /**
+     * version is the version of the tree the keys were copied from.
+     * */
+    unsigned long version;
+    /**
+     * search returns true if the input key is present in the index and false if it is not.
+     * */
+    bool search(const Key &num) const {
+        const Key *found = NULL;
+        size_t k = 0;
+        while (k < num_blocks) {
+            const Key *block = blocks + k * FROZEN_BLOCK;
+            int i = rank_in_block(block, num);
+            //the first key of the block that is not smaller than num, if any, is the best candidate so far
+            if (i < FROZEN_BLOCK) {
+                found = block + i;
+            }
+            k = k * (FROZEN_BLOCK + 1) + i + 1;
+        }
+        return found != NULL && !comp(num, *found);
+    }
+    /**
+     * Constructor for the FrozenIndex class. It copies the keys of t, which must not change meanwhile, in linear time.
+     * */
+    template <class Value>
+    FrozenIndex(RBtree<Key, Value, Compare> *t) {
+        static_assert(is_trivially_copyable<Key>::value, "a FrozenIndex needs keys that can be copied byte by byte");
+        version = t->version.load();
+        vector<Key> keys;
+        keys.reserve(t->size());
+        for (typename RBtree<Key, Value, Compare>::iterator it = t->begin(); it != t->end(); ++it) {
+            keys.push_back(*it);
+        }
+        num_blocks = (keys.size() + FROZEN_BLOCK - 1) / FROZEN_BLOCK;
+        blocks = NULL;
+        if (num_blocks > 0) {
+            blocks = (Key *) aligned_alloc(64, (num_blocks * FROZEN_BLOCK * sizeof(Key) + 63) / 64 * 64);
+            size_t next = 0;
+            fill(keys, 0, next);
+        }
+    }
+    /**
+     * Destructor for the FrozenIndex class
+     * */
+    ~FrozenIndex() {
+        free(blocks);
+    }
+    FrozenIndex(const FrozenIndex &) = delete;
+    FrozenIndex & operator=(const FrozenIndex &) = delete;
+
+    private:
+    //the blocks, one after the other
+    Key *blocks;
+    size_t num_blocks;
+    Compare comp;
+
+    /**
+     * fill stores the sorted keys, starting at keys[next], in the subtree of block k in order. Slots past the last key
+     * repeat the last key, so every block stays sorted and a search never mistakes a slot for a missing key.
+     * */
+    void fill(const vector<Key> &keys, size_t k, size_t &next) {
+        if (k >= num_blocks) {
+            return;
+        }
+        for (int i=0; i<FROZEN_BLOCK; i++) {
+            fill(keys, k * (FROZEN_BLOCK + 1) + i + 1, next);
+            blocks[k * FROZEN_BLOCK + i] = next < keys.size() ? keys[next++] : keys.back();
+        }
+        fill(keys, k * (FROZEN_BLOCK + 1) + FROZEN_BLOCK + 1, next);
+    }
+
+    /**
+     * rank_in_block returns the number of keys of the block that are smaller than num.
+     * */
+    int rank_in_block(const Key *block, const Key &num) const {
+#ifdef __SSE2__
+        if constexpr (is_same<Key, int>::value && is_same<Compare, less<int> >::value) {
+            __m128i x = _mm_set1_epi32(num);
+            int mask = 0;
+            for (int q=0; q<FROZEN_BLOCK / 4; q++) {
+                __m128i smaller = _mm_cmpgt_epi32(x, _mm_load_si128((const __m128i *) (block + 4 * q)));
+                mask |= _mm_movemask_ps(_mm_castsi128_ps(smaller)) << (4 * q);
+            }
+            return __builtin_popcount(mask);
+        }
+#endif
+        int i = 0;
+        for (int j=0; j<FROZEN_BLOCK; j++) {
+            i += comp(block[j], num);
+        }
+        return i;
+    }
+};
+
+/**
+ * The FrozenView class answers searches on a tree from a FrozenIndex of it while the index is current, and rebuilds
+ * the index once the tree has stopped changing. Every method must be called while the tree is held: search while it is
+ * held shared and reclaim while it is held exclusively.
+ * */
+template <class Key, class Value = Empty, class Compare = less<Key> >
+class FrozenView {
+    public:
+    typedef FrozenIndex<Key, Compare> Index;
+    /**
+     * search returns true if the input key is present in the tree t and false if it is not. It uses the index when it
+     * matches the version of t. Otherwise it searches t itself and, when quiet is true because no modification is
+     * waiting, first rebuilds the index unless another thread is already at it.
+     * */
+    bool search(RBtree<Key, Value, Compare> *t, const Key &num, bool quiet) {
+        Index *f = current.load(memory_order_acquire);
+        if (f != NULL && f->version == t->version.load()) {
+            return f->search(num);
+        }
+        if (quiet && rebuilding.try_lock()) {
+            f = current.load(memory_order_acquire);
+            if (f == NULL || f->version != t->version.load()) {
+                //other searches may still be reading the old index, so it is only freed by reclaim
+                if (f != NULL) {
+                    retired.push_back(f);
+                }
+                f = new Index(t);
+                current.store(f, memory_order_release);
+            }
+            rebuilding.unlock();
+            return f->search(num);
+        }
+        return t->search(num);
+    }
+    /**
+     * reclaim frees the indices that have been replaced. No search can be reading them while the tree is held exclusively.
+     * */
+    void reclaim() {
+        for (size_t i=0; i<retired.size(); i++) {
+            delete retired[i];
+        }
+        retired.clear();
+    }
+    /**
+     * Constructor for the FrozenView class
+     * */
+    FrozenView() : current(NULL) {
+    }
+    /**
+     * Destructor for the FrozenView class. Frees every index.
+     * */
+    ~FrozenView() {
+        reclaim();
+        delete current.load();
+    }
+    FrozenView(const FrozenView &) = delete;
+    FrozenView & operator=(const FrozenView &) = delete;
+
+    private:
+    //the latest index, or NULL before the first one is built
+    atomic<Index *> current;
+    //replaced indices waiting for reclaim
+    vector<Index *> retired;
+    //held by the search thread that is rebuilding the index
+    mutex rebuilding;
+};
+
+#endif
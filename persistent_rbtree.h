@@ -0,0 +1,673 @@
+/**
+ * persistent_rbtree.h defines PersistentRBtree, a red black tree whose modifications copy the nodes on their path
+ * instead of changing them, so every version of the tree stays intact. A modification builds the next version next to
+ * the current one and publishes it with a single atomic store of the root, so searches read a consistent version
+ * without taking any lock and never wait for a modification. Replaced nodes are freed through epochs once no search
+ * can still be reading the version they belong to.
+ *
+ * Modifications are built on join: insert splits the tree at the key and joins the two halves around the new node,
+ * and delete_node splits out the node and joins what is left, copying O(log n) nodes either way. The black heights of
+ * the pieces are carried along, so no join has to walk down a tree to measure them.
+ **/
+#include "rbtree.h"
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <utility>
+
+#ifndef PERSISTENT_RBTREE_H_
+#define PERSISTENT_RBTREE_H_
+
+using namespace std;
+
+/**
+ * EPOCH_SLOTS is the number of threads that can announce their reads at once. Threads beyond it still read safely
+ * but hold back every reclamation while they do.
+ * */
+#define EPOCH_SLOTS 128
+
+/**
+ * The Epochs class tracks which versions the reading threads may still hold. A reader announces the epoch in which it
+ * started; nodes replaced in an epoch can be freed once every announced epoch is later.
+ * */
+class Epochs {
+    public:
+    /**
+     * enter announces that the calling thread is about to read the current version of a tree.
+     * */
+    void enter() {
+        int s = slot();
+        if (s < 0) {
+            overflow++;
+            return;
+        }
+        //announced before the root is read, so a writer that misses the announcement has already published
+        slots[s].entered.store(epoch.load());
+    }
+    /**
+     * exit announces that the calling thread no longer holds any node of the version it read.
+     * */
+    void exit() {
+        int s = slot();
+        if (s < 0) {
+            overflow--;
+            return;
+        }
+        slots[s].entered.store(IDLE);
+    }
+    /**
+     * advance ends the current epoch, after a new version has been published, and returns it.
+     * */
+    unsigned long advance() {
+        return epoch.fetch_add(1);
+    }
+    /**
+     * oldest returns the earliest epoch a reader may still be reading in. Nodes replaced in earlier epochs are free.
+     * */
+    unsigned long oldest() {
+        if (overflow.load() > 0) {
+            return 0;
+        }
+        unsigned long e = epoch.load();
+        for (int i=0; i<EPOCH_SLOTS; i++) {
+            unsigned long entered = slots[i].entered.load();
+            if (entered < e) {
+                e = entered;
+            }
+        }
+        return e;
+    }
+    /**
+     * Constructor for the Epochs class
+     * */
+    Epochs() : epoch(1), overflow(0) {
+        for (int i=0; i<EPOCH_SLOTS; i++) {
+            slots[i].entered.store(IDLE);
+            slots[i].taken.store(false);
+        }
+    }
+    Epochs(const Epochs &) = delete;
+    Epochs & operator=(const Epochs &) = delete;
+
+    private:
+    //the entered epoch of a slot whose thread is not reading
+    static const unsigned long IDLE = ~0UL;
+    /**
+     * The Slot struct is where one thread announces its reads, on a cache line of its own.
+     * */
+    struct alignas(64) Slot {
+        atomic<unsigned long> entered;
+        atomic<bool> taken;
+    };
+    Slot slots[EPOCH_SLOTS];
+    atomic<unsigned long> epoch;
+    //readers that found no free slot
+    atomic<int> overflow;
+
+    /**
+     * slot returns the slot of the calling thread, claiming one on its first read. Returns -1 if they are all taken.
+     * */
+    int slot() {
+        static thread_local int mine = -2;
+        if (mine == -2) {
+            mine = -1;
+            for (int i=0; i<EPOCH_SLOTS && mine < 0; i++) {
+                bool expected = false;
+                if (slots[i].taken.compare_exchange_strong(expected, true)) {
+                    mine = i;
+                }
+            }
+        }
+        return mine;
+    }
+};
+
+/**
+ * epochs returns the epochs shared by every PersistentRBtree.
+ * */
+inline Epochs & epochs() {
+    static Epochs e;
+    return e;
+}
+
+/**
+ * The PersistentRBtree class keeps the versions of a red black tree apart by path copying. Its nodes are Nodes whose
+ * leaves are NULL and whose parent is left unused, and a published node is never changed. Searches and queries take
+ * no lock; modifications are serialized by a mutex of their own.
+ * */
+template <class Key, class Value = Empty, class Compare = less<Key> >
+class PersistentRBtree {
+    public:
+    typedef ::Node<Key, Value> Node;
+    typedef RBtree<Key, Value, Compare> Tree;
+    /**
+     * comp orders the keys.
+     * */
+    Compare comp;
+    /**
+     * read_begin announces a read and returns the root of the current version, which stays intact until read_end.
+     * */
+    const Node * read_begin() {
+        epochs().enter();
+        return root.load();
+    }
+    /**
+     * read_end ends the read started by read_begin on the calling thread.
+     * */
+    void read_end() {
+        epochs().exit();
+    }
+    /**
+     * search returns true if the input key is present in the tree and false if it is not.
+     * */
+    bool search(const Key &num);
+    /**
+     * rank returns the number of keys smaller than num.
+     * */
+    int rank(const Key &num);
+    /**
+     * select sets key to the k-th smallest key, counting from 1. Returns false if there are fewer than k keys.
+     * */
+    bool select(int k, Key &key);
+    /**
+     * range_count returns the number of keys between lo and hi, both included.
+     * */
+    int range_count(const Key &lo, const Key &hi);
+    /**
+     * scan calls f on every node with a key between lo and hi, both included, in key order, all from one version.
+     * */
+    template <class F>
+    void scan(const Key &lo, const Key &hi, F f);
+    /**
+     * insert publishes a version with the key num, mapped to value, added. Like RBtree::insert it adds the key even if
+     * it is already there.
+     * */
+    void insert(const Key &num, const Value &value = Value());
+    /**
+     * delete_node publishes a version without one node with the key num, if there is one.
+     * */
+    void delete_node(const Key &num);
+    /**
+     * snapshot copies the current version, shape and colors included, into a new RBtree and returns it. Modifications
+     * can go on meanwhile.
+     * */
+    Tree * snapshot();
+    /**
+     * Constructor for the PersistentRBtree class. It copies the keys, values, shape and colors of t.
+     * */
+    PersistentRBtree(Tree *t);
+    PersistentRBtree(const PersistentRBtree &) = delete;
+    PersistentRBtree & operator=(const PersistentRBtree &) = delete;
+
+    private:
+    atomic<Node *> root;
+    //nodes are only allocated and released by the thread holding write_lock
+    NodePool<Node> pool;
+    mutex write_lock;
+    //nodes replaced by the modification in progress
+    vector<Node *> retired;
+    //nodes replaced by earlier modifications, with the epoch they were replaced in
+    vector<pair<unsigned long, vector<Node *> > > limbo;
+
+    static int size(const Node *t) {
+        return t == NULL ? 0 : t->size;
+    }
+    static bool red(const Node *t) {
+        return t != NULL && t->color;
+    }
+    Node * copy(Node *t);
+    Node * link(Node *l, Node *k, Node *r, bool red);
+    int black_height(Node *t);
+    Node * join_right(Node *l, int hl, Node *k, Node *r, int hr);
+    Node * join_left(Node *l, int hl, Node *k, Node *r, int hr);
+    Node * join(Node *l, int hl, Node *k, Node *r, int hr, int &h);
+    Node * join2(Node *l, int hl, Node *r, int hr);
+    Node * split_last(Node *t, int ht, Node *&rest, int &hr);
+    void split(Node *t, int ht, const Key &num, Node *&l, int &hl, Node *&r, int &hr, Node **found);
+    void publish(Node *t);
+    Node * copy_from(Tree *t, typename Tree::Node *n);
+    typename Tree::Node * copy_to(Tree *t, const Node *n);
+};
+
+/**
+ * search returns true if the input key is present in the tree and false if it is not.
+ * */
+template <class Key, class Value, class Compare>
+bool PersistentRBtree<Key, Value, Compare>::search(const Key &num) {
+    const Node *n = read_begin();
+    while (n != NULL) {
+        if (comp(num, n->key)) {
+            n = n->left;
+        } else if (comp(n->key, num)) {
+            n = n->right;
+        } else {
+            break;
+        }
+    }
+    read_end();
+    return n != NULL;
+}
+
+/**
+ * rank returns the number of keys smaller than num.
+ * */
+template <class Key, class Value, class Compare>
+int PersistentRBtree<Key, Value, Compare>::rank(const Key &num) {
+    const Node *n = read_begin();
+    int count = 0;
+    while (n != NULL) {
+        if (comp(n->key, num)) {
+            count += size(n->left) + 1;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    read_end();
+    return count;
+}
+
+/**
+ * select sets key to the k-th smallest key, counting from 1. Returns false if there are fewer than k keys.
+ * */
+template <class Key, class Value, class Compare>
+bool PersistentRBtree<Key, Value, Compare>::select(int k, Key &key) {
+    const Node *n = read_begin();
+    bool found = false;
+    if (k >= 1 && k <= size(n)) {
+        while (true) {
+            int left = size(n->left);
+            if (k <= left) {
+                n = n->left;
+            } else if (k == left + 1) {
+                break;
+            } else {
+                k -= left + 1;
+                n = n->right;
+            }
+        }
+        key = n->key;
+        found = true;
+    }
+    read_end();
+    return found;
+}
+
+/**
+ * range_count returns the number of keys between lo and hi, both included.
+ * */
+template <class Key, class Value, class Compare>
+int PersistentRBtree<Key, Value, Compare>::range_count(const Key &lo, const Key &hi) {
+    if (comp(hi, lo)) {
+        return 0;
+    }
+    const Node *t = read_begin();
+    //the keys not larger than hi minus the keys smaller than lo, both counted in the same version
+    int count = 0;
+    for (const Node *n = t; n != NULL;) {
+        if (comp(hi, n->key)) {
+            n = n->left;
+        } else {
+            count += size(n->left) + 1;
+            n = n->right;
+        }
+    }
+    for (const Node *n = t; n != NULL;) {
+        if (comp(n->key, lo)) {
+            count -= size(n->left) + 1;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    read_end();
+    return count;
+}
+
+/**
+ * scan calls f on every node with a key between lo and hi, both included, in key order, all from one version.
+ * */
+template <class Key, class Value, class Compare>
+template <class F>
+void PersistentRBtree<Key, Value, Compare>::scan(const Key &lo, const Key &hi, F f) {
+    const Node *n = read_begin();
+    //the nodes whose key and right subtree are still to come, without parent pointers to climb back up
+    vector<const Node *> stack;
+    while (n != NULL || !stack.empty()) {
+        if (n != NULL) {
+            if (comp(n->key, lo)) {
+                n = n->right;
+            } else {
+                stack.push_back(n);
+                n = n->left;
+            }
+            continue;
+        }
+        n = stack.back();
+        stack.pop_back();
+        if (comp(hi, n->key)) {
+            break;
+        }
+        f(n);
+        n = n->right;
+    }
+    read_end();
+}
+
+/**
+ * copy returns a new node with the key, value, children and color of t and retires t.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::copy(Node *t) {
+    Node *n = pool.allocate();
+    n->key = t->key;
+    n->set_value(t->get_value());
+    n->left = t->left;
+    n->right = t->right;
+    n->color = t->color;
+    n->size = t->size;
+    retired.push_back(t);
+    return n;
+}
+
+/**
+ * link makes l and r the children of k, which must not be published yet, colors k and returns it.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::link(Node *l, Node *k, Node *r, bool red) {
+    k->left = l;
+    k->right = r;
+    k->color = red;
+    k->size = size(l) + size(r) + 1;
+    return k;
+}
+
+/**
+ * black_height returns the number of black nodes on any path from t down to a leaf, counting t.
+ * */
+template <class Key, class Value, class Compare>
+int PersistentRBtree<Key, Value, Compare>::black_height(Node *t) {
+    int h = 0;
+    for (; t != NULL; t = t->left) {
+        h += !t->color;
+    }
+    return h;
+}
+
+/**
+ * join_right joins l, k and r where l, of black height hl, is at least as high as r, of black height hr, by hanging
+ * k and r on a copy of the right spine of l. The root of the result may be red with a red right child.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::join_right(Node *l, int hl, Node *k, Node *r, int hr) {
+    if (!red(l) && hl == hr) {
+        return link(l, k, r, true);
+    }
+    Node *t = copy(l);
+    t = link(t->left, t, join_right(t->right, hl - !t->color, k, r, hr), t->color);
+    //two reds in a row below a black node: rotate left. Both reds were made by this join, so they can be changed
+    if (!t->color && red(t->right) && red(t->right->right)) {
+        t->right->right->color = false;
+        Node *x = t->right;
+        return link(link(t->left, t, x->left, false), x, x->right, true);
+    }
+    return t;
+}
+
+/**
+ * join_left is join_right with the sides swapped: r is higher and k and l are hung on a copy of its left spine.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::join_left(Node *l, int hl, Node *k, Node *r, int hr) {
+    if (!red(r) && hl == hr) {
+        return link(l, k, r, true);
+    }
+    Node *t = copy(r);
+    t = link(join_left(l, hl, k, t->left, hr - !t->color), t, t->right, t->color);
+    if (!t->color && red(t->left) && red(t->left->left)) {
+        t->left->left->color = false;
+        Node *x = t->left;
+        return link(x->left, x, link(x->right, t, t->right, false), true);
+    }
+    return t;
+}
+
+/**
+ * join returns a tree of the keys of l, then k, then the keys of r, where k is a node that is not published yet, and
+ * sets h to its black height. hl and hr are the black heights of l and r. Every key of l must not be larger than k
+ * and every key of r not smaller.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::join(Node *l, int hl, Node *k, Node *r, int hr, int &h) {
+    //a subtree cut out of a tree may have a red root; a black copy of it is still a red black tree
+    if (red(l)) {
+        l = copy(l);
+        l->color = false;
+        hl++;
+    }
+    if (red(r)) {
+        r = copy(r);
+        r->color = false;
+        hr++;
+    }
+    Node *t;
+    if (hl > hr) {
+        //the result is as high as l, unless its root has to turn black
+        t = join_right(l, hl, k, r, hr);
+        h = hl;
+        if (t->color && red(t->right)) {
+            t->color = false;
+            h++;
+        }
+    } else if (hl < hr) {
+        t = join_left(l, hl, k, r, hr);
+        h = hr;
+        if (t->color && red(t->left)) {
+            t->color = false;
+            h++;
+        }
+    } else {
+        t = link(l, k, r, false);
+        h = hl + 1;
+    }
+    return t;
+}
+
+/**
+ * split_last sets rest to t, of black height ht, without its node with the largest key and hr to the black height of
+ * rest, and returns a copy of that node.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::split_last(Node *t, int ht, Node *&rest, int &hr) {
+    int hc = ht - !t->color;
+    if (t->right == NULL) {
+        rest = t->left;
+        hr = hc;
+        return copy(t);
+    }
+    Node *r;
+    int h;
+    Node *last = split_last(t->right, hc, r, h);
+    Node *k = copy(t);
+    rest = join(k->left, hc, k, r, h, hr);
+    return last;
+}
+
+/**
+ * join2 returns a tree of the keys of l followed by the keys of r. hl and hr are their black heights.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::join2(Node *l, int hl, Node *r, int hr) {
+    if (l == NULL) {
+        return r;
+    }
+    Node *rest;
+    int h;
+    Node *k = split_last(l, hl, rest, h);
+    return join(rest, h, k, r, hr, h);
+}
+
+/**
+ * split splits t, of black height ht, into l, the keys smaller than num, and r, the larger ones, of black heights hl
+ * and hr, copying the nodes on the path to num. When found is NULL the keys equal to num go to r; otherwise one node
+ * with the key num, if there is one, is left out, retired and stored in *found.
+ * */
+template <class Key, class Value, class Compare>
+void PersistentRBtree<Key, Value, Compare>::split(Node *t, int ht, const Key &num, Node *&l, int &hl, Node *&r, int &hr, Node **found) {
+    if (t == NULL) {
+        l = NULL;
+        r = NULL;
+        hl = 0;
+        hr = 0;
+        return;
+    }
+    //the black height of both children
+    int hc = ht - !t->color;
+    if (comp(num, t->key) || (found == NULL && !comp(t->key, num))) {
+        Node *rl;
+        int h;
+        split(t->left, hc, num, l, hl, rl, h, found);
+        Node *k = copy(t);
+        r = join(rl, h, k, k->right, hc, hr);
+    } else if (comp(t->key, num)) {
+        Node *lr;
+        int h;
+        split(t->right, hc, num, lr, h, r, hr, found);
+        Node *k = copy(t);
+        l = join(k->left, hc, k, lr, h, hl);
+    } else {
+        l = t->left;
+        r = t->right;
+        hl = hc;
+        hr = hc;
+        retired.push_back(t);
+        *found = t;
+    }
+}
+
+/**
+ * publish makes t, with a black root, the current version. The nodes the modification replaced are freed once no
+ * reader can hold them, along with those of earlier modifications whose readers are gone.
+ * */
+template <class Key, class Value, class Compare>
+void PersistentRBtree<Key, Value, Compare>::publish(Node *t) {
+    //t may be a subtree of the current version, which must not change
+    if (red(t)) {
+        t = copy(t);
+        t->color = false;
+    }
+    root.store(t);
+    //readers that start from now on can only find t
+    limbo.push_back(make_pair(epochs().advance(), vector<Node *>()));
+    limbo.back().second.swap(retired);
+    unsigned long oldest = epochs().oldest();
+    size_t done = 0;
+    while (done < limbo.size() && limbo[done].first < oldest) {
+        for (size_t i=0; i<limbo[done].second.size(); i++) {
+            pool.release(limbo[done].second[i]);
+        }
+        done++;
+    }
+    limbo.erase(limbo.begin(), limbo.begin() + done);
+}
+
+/**
+ * insert publishes a version with the key num, mapped to value, added. Like RBtree::insert it adds the key even if
+ * it is already there.
+ * */
+template <class Key, class Value, class Compare>
+void PersistentRBtree<Key, Value, Compare>::insert(const Key &num, const Value &value) {
+    lock_guard<mutex> lk(write_lock);
+    Node *t = root.load();
+    Node *l, *r;
+    int hl, hr, h;
+    split(t, black_height(t), num, l, hl, r, hr, NULL);
+    Node *k = pool.allocate();
+    k->key = num;
+    k->set_value(value);
+    publish(join(l, hl, k, r, hr, h));
+}
+
+/**
+ * delete_node publishes a version without one node with the key num, if there is one.
+ * */
+template <class Key, class Value, class Compare>
+void PersistentRBtree<Key, Value, Compare>::delete_node(const Key &num) {
+    lock_guard<mutex> lk(write_lock);
+    Node *t = root.load();
+    //leave the current version alone if there is nothing to delete
+    Node *n = t;
+    while (n != NULL && (comp(num, n->key) || comp(n->key, num))) {
+        n = comp(num, n->key) ? n->left : n->right;
+    }
+    if (n == NULL) {
+        return;
+    }
+    Node *l, *r;
+    int hl, hr;
+    Node *found = NULL;
+    split(t, black_height(t), num, l, hl, r, hr, &found);
+    publish(join2(l, hl, r, hr));
+}
+
+/**
+ * copy_to copies the subtree n into new nodes of the tree t, shape and colors included, and returns its root.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Tree::Node * PersistentRBtree<Key, Value, Compare>::copy_to(Tree *t, const Node *n) {
+    if (n == NULL) {
+        return t->nil;
+    }
+    typename Tree::Node *c = t->pool.allocate();
+    c->key = n->key;
+    c->set_value(n->get_value());
+    c->color = n->color;
+    c->size = n->size;
+    c->left = copy_to(t, n->left);
+    c->right = copy_to(t, n->right);
+    if (c->left != t->nil) {
+        c->left->parent = c;
+    }
+    if (c->right != t->nil) {
+        c->right->parent = c;
+    }
+    return c;
+}
+
+/**
+ * snapshot copies the current version, shape and colors included, into a new RBtree and returns it. Modifications
+ * can go on meanwhile.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Tree * PersistentRBtree<Key, Value, Compare>::snapshot() {
+    //every node of a version knows the size of its subtree, so the copy can too
+    Tree *t = new Tree(true);
+    t->root = copy_to(t, read_begin());
+    read_end();
+    t->root->parent = t->nil;
+    return t;
+}
+
+/**
+ * copy_from copies the subtree n of the tree t into new nodes and returns its root.
+ * */
+template <class Key, class Value, class Compare>
+typename PersistentRBtree<Key, Value, Compare>::Node * PersistentRBtree<Key, Value, Compare>::copy_from(Tree *t, typename Tree::Node *n) {
+    if (n == t->nil) {
+        return NULL;
+    }
+    Node *c = pool.allocate();
+    c->key = n->key;
+    c->set_value(n->get_value());
+    return link(copy_from(t, n->left), c, copy_from(t, n->right), n->color);
+}
+
+/**
+ * Constructor for the PersistentRBtree class. It copies the keys, values, shape and colors of t.
+ * */
+template <class Key, class Value, class Compare>
+PersistentRBtree<Key, Value, Compare>::PersistentRBtree(Tree *t) {
+    root.store(copy_from(t, t->root));
+}
+
+#endif
@@ -7,566 +7,1346 @@
  **/
 
 #include "rbtree.h"
+#include "sharded_rbtree.h"
+#include "frozen_index.h"
+#include "persistent_rbtree.h"
+#include "wal.h"
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <queue>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
 
 using namespace std;
-pthread_t tid;
 mutex x;
-mutex wsem;
-mutex rsem;
-bool done = false;
-queue<int> search_queue;
-queue<string> modify_queue;
+RWlock tree_lock;
+//held by the modify thread that is applying a batch in combining mode
+mutex combine_lock;
+//signalled when commands are queued, when the input is parsed and when the last pending search finishes
+condition_variable work_ready;
+condition_variable space_ready;
+bool parsing_done = false;
+atomic<int> pending_searches(0);
+atomic<int> pending_modifications(0);
+queue<Command> search_queue;
+queue<Command> modify_queue;
+vector<pthread_t> workers;
+const char *command_names[NUM_COMMANDS] = {"search", "insert", "delete", "rank", "select", "range_count", "range"};
+const char *policy_names[NUM_POLICIES] = {"reader-preferring", "writer-preferring", "phase-fair"};
+//how the tree lock picks between searches and modifications
+RWPolicy scheduling = READER_PREFERRING;
 chrono::high_resolution_clock::time_point start, complete;
-vector<string> thread_results;
-RBtree *tree;
+//the results of every worker thread, indexed by thread id
+vector<ResultLog> result_logs;
+//the result log of the calling worker thread
+thread_local ResultLog *my_log;
+RBtree<int> *tree;
+//the tree split into key ranges while the commands run, or NULL when it is not sharded
+ShardedRBtree<int> *sharded = NULL;
+int num_shards = 1;
+//the tree in path copying mode while the commands run, or NULL when it is off
+PersistentRBtree<int> *persistent = NULL;
+bool path_copying = false;
+//the frozen index the searches use when it is turned on, or NULL
+FrozenView<int> *frozen = NULL;
+bool optimistic = false;
+bool combining = false;
+//number of searches a search thread takes off the queue at once
+size_t batch_size = 1;
+char *load_path = NULL;
+char *save_path = NULL;
+char *dump_path = NULL;
+bool skip_dump = false;
+//the write-ahead log of the modifications, or NULL when they are not logged
+WriteAheadLog<int> *wal = NULL;
+char *log_path = NULL;
+size_t log_group_size = LOG_GROUP_SIZE;
+unsigned long log_group_interval = LOG_GROUP_INTERVAL;
+//orders the modifications of the path copying tree with their log records
+mutex log_order;
+//the socket the server listens on, "-" for the standard input, or NULL when the program runs the input file and exits
+char *serve_path = NULL;
+atomic<bool> shutdown_requested(false);
+//clients of the server that are still connected
+mutex clients_lock;
+vector<Connection *> clients;
+#ifdef RB_STATS
+//counters of every worker thread, indexed by thread id
+vector<ThreadStats> thread_stats;
+//the counters of the calling worker thread
+thread_local ThreadStats *my_stats;
+#endif
 
 /**
- * search returns true if the input integer is present in the tree
- * and false if it is not.
+ * now_ns returns a monotonic timestamp in nanoseconds for the result logs and the instrumentation.
  * */
-bool RBtree::search(int num) {
-    Node *tmp = root;
-    do {
-        if (tmp->key == num) {
-            return true;
-        //if node's key is greater, check it's left children
-        } else if (tmp->key > num) {
-            tmp = tmp->left;
-        //if node's key is less than, check it's right children
-        } else {
-            tmp = tmp->right;
-        }
-    } while (tmp != nil);
-    return false;
+unsigned long now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 /**
- * get_minimum is a helper search function that returns the node with the smallest key value that belongs
- * to the subtree starting at node n.
+ * create_tree builds the tree from the nodes as listed on the first line of the input file: comma separated keys
+ * followed by their color in preorder, with "f" for every nil leaf. It takes in a pointer to the characters of the
+ * line and their count and adds the nodes in a single pass, keeping the nodes whose children are still missing on an
+ * explicit stack instead of recursing. Returns a pointer to the tree.
  * */
-Node * RBtree::get_minimum(Node *n) {
-    Node *tmp = n;
-    while (tmp->left != nil) {
-        tmp = tmp->left;
+RBtree<int> * create_tree(const char *line, size_t len) {
+    //rank, select and range_count need the subtree sizes
+    RBtree<int> *tree = new RBtree<int>(true);
+    const char *p = line;
+    const char *end = line + len;
+    //nodes whose right child has not been read yet; a node whose left child has not been read yet has left == NULL
+    vector<Node<int> *> open;
+    bool first = true;
+    while (p < end) {
+        //find the end of this node's token
+        const char *tok = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        const char *tok_end = p;
+        p++;
+        while (tok_end > tok && (tok_end[-1] == ' ' || tok_end[-1] == '\r' || tok_end[-1] == '\n')) {
+            tok_end--;
+        }
+        if (tok_end == tok) {
+            continue;
+        }
+        //the tree is null
+        if (first && (string(tok, tok_end) == "NULL" || string(tok, tok_end) == "null")) {
+            break;
+        }
+        Node<int> *n = tree->nil;
+        char col = tok_end[-1];
+        if (col != 'f') {
+            n = tree->pool.allocate();
+            n->key = (int) strtol(tok, NULL, 10);
+            n->color = col == 'r';
+            n->parent = tree->nil;
+        }
+        //attach the node to the closest node that is still missing a child
+        if (first) {
+            tree->root = n;
+            first = false;
+        } else if (open.empty()) {
+            break;
+        } else {
+            Node<int> *top = open.back();
+            if (top->left == NULL) {
+                top->left = n;
+            } else {
+                top->right = n;
+                open.pop_back();
+            }
+            if (n != tree->nil) {
+                n->parent = top;
+            }
+        }
+        if (n != tree->nil) {
+            open.push_back(n);
+        }
     }
-    return tmp;
+    //children missing from the end of the line are nil leaves
+    for (size_t i=0; i<open.size(); i++) {
+        if (open[i]->left == NULL) {
+            open[i]->left = tree->nil;
+        }
+        open[i]->right = tree->nil;
+    }
+    tree->root->parent = tree->nil;
+    tree->compute_sizes();
+    return tree;
 }
 
 /**
- * delete_node removes the node with the inputted key value from the tree
- * if it exists. It calls helper functions to maintain the red black characteristics.
+ * add_result appends the result of the command c to the log of the calling thread, stamped with the current time.
  * */
-void RBtree::delete_node(int num) {
-    Node *n = root;
-    Node *x = NULL;
-    //find the node with this integer value
-    while (n->key != num) {
-        if (n->key > num) {
-            n = n->left;
-        } else {
-            n = n->right;
-        }
-    }
-    Node *tmp = n;
-    bool orig_color = tmp->color;
-    
-    if (n->left == nil) {
-        x = n->right;
-        transplant(n, n->right);
-    } else if (n->right == nil) {
-        x = n->left;
-        transplant(n, n->left);
-    } else {
-        tmp = get_minimum(n->right);
-        orig_color = tmp->color;
-        x = tmp->right;
-        if (tmp->parent == n) {
-            x->parent = tmp;
-        } else {
-            transplant(tmp, tmp->right);
-            tmp->right = n->right;
-            tmp->right->parent = tmp;
+void add_result(const Command &c, long outcome, int length) {
+    Result r;
+    r.time = now_ns();
+    r.c = c;
+    r.outcome = outcome;
+    r.length = length;
+    r.thread = my_log->thread;
+    if (c.req != NULL) {
+        //a command sent to the server is answered as soon as it is done instead of being logged
+        vector<int> &keys = my_log->keys;
+        format_result(c.req->lines[c.slot], r, c.op == RANGE ? keys.data() + outcome : NULL);
+        if (c.op == RANGE) {
+            keys.resize(outcome);
         }
-        transplant(n, tmp);
-        tmp->left = n->left;
-        tmp->left->parent = tmp;
-        tmp->color = n->color;
-    }
-    if (!orig_color) {
-        delete_node_fixup(x);
+        //the request may be freed as soon as it is complete, so what is needed of it is looked up first
+        Connection *conn = c.req->conn;
+        bool modifies = c.req->modifies;
+        if (--c.req->remaining == 0) {
+            lock_guard<mutex> lk(conn->lock);
+            conn->running--;
+            if (modifies) {
+                conn->modifying--;
+            }
+            //the responder and the next request of the client may both be waiting
+            conn->ready.notify_all();
+        }
+        return;
     }
+    my_log->results.push_back(r);
 }
 
 /**
- * insert inserts a new node with the given key value into the tree. It calls helper
- * functions to maintain the red black characteristics.
+ * run_query runs a command that only reads the tree and adds its result to the log of the calling thread.
+ * Searches take no lock when optimistic searches are on; every other query holds the tree lock shared. With the frozen
+ * index turned on, searches are answered from it instead, whether or not optimistic searches are on.
  * */
-void RBtree::insert(int num) {
-    Node *n = new Node();
-    n->key = num;
-    //assume color is red at start
-    n->color = true;
-    Node *x = root;
-    Node *y = nil;
-    //figure out where n should be placed based on normal BST
-    while (x != nil) {
-        //y saves the what should be the parent node of n
-        y = x;
-        if (n->key < x->key) {
-            x = x->left;
-        } else {
-            x = x->right;
+void run_query(const Command &c) {
+    if (sharded != NULL) {
+        run_sharded_query(c);
+        return;
+    }
+    if (persistent != NULL) {
+        run_persistent_query(c);
+        return;
+    }
+    if (c.op == SEARCH && optimistic && frozen == NULL) {
+        add_result(c, tree->search_optimistic(c.key), 0);
+        return;
+    }
+    RB_STAT(unsigned long t0 = now_ns();)
+    tree_lock.lock_shared();
+    RB_STAT(unsigned long t1 = now_ns(); my_stats->lock_wait_ns += t1 - t0; my_stats->lock_acquisitions++;)
+    if (c.op == SEARCH) {
+        //the frozen index is rebuilt only while no modification is waiting
+        bool found = frozen != NULL ? frozen->search(tree, c.key, pending_modifications == 0) : tree->search(c.key);
+        add_result(c, found, 0);
+    } else if (c.op == RANK) {
+        add_result(c, tree->rank(c.key), 0);
+    } else if (c.op == SELECT) {
+        Node<int> *n = tree->select(c.key);
+        add_result(c, n != tree->nil ? n->key : 0, n != tree->nil);
+    } else if (c.op == RANGE_COUNT) {
+        add_result(c, tree->range_count(c.key, c.key2), 0);
+    } else if (c.op == RANGE) {
+        //copy the keys straight from the tree into the log
+        vector<int> &keys = my_log->keys;
+        size_t first = keys.size();
+        for (RBtree<int>::iterator it = tree->lower_bound(c.key); it != tree->end() && *it <= c.key2; ++it) {
+            keys.push_back(*it);
         }
+        add_result(c, first, keys.size() - first);
     }
-    n->parent = y;
-    //is n root, right child, or left child?
-    if (y == nil) {
-        root = n;
-    } else if (n->key < y->key) {
-        y->left = n;
-    } else {
-        y->right = n;
+    RB_STAT(my_stats->lock_hold_ns += now_ns() - t1;)
+    tree_lock.unlock_shared();
+}
+
+/**
+ * run_sharded_query is run_query for a sharded tree. Each query locks the shards it reads itself.
+ * */
+void run_sharded_query(const Command &c) {
+    if (c.op == SEARCH) {
+        add_result(c, optimistic ? sharded->search_optimistic(c.key) : sharded->search(c.key), 0);
+    } else if (c.op == RANK) {
+        add_result(c, sharded->rank(c.key), 0);
+    } else if (c.op == SELECT) {
+        int key = 0;
+        bool found = sharded->select(c.key, key);
+        add_result(c, key, found);
+    } else if (c.op == RANGE_COUNT) {
+        add_result(c, sharded->range_count(c.key, c.key2), 0);
+    } else if (c.op == RANGE) {
+        //copy the keys of every shard in the range into the log
+        vector<int> &keys = my_log->keys;
+        size_t first = keys.size();
+        sharded->scan(c.key, c.key2, [&](Node<int> *n) {
+            keys.push_back(n->key);
+        });
+        add_result(c, first, keys.size() - first);
     }
-    n->left = nil;
-    n->right = nil;
-    //fix any rb properties that were violated during insertion
-    insert_fixup(n);
 }
 
 /**
- * transplant is a helper method for deletions that changes the relationships of the nodes during deletion.
+ * run_persistent_query is run_query for a tree in path copying mode. Each query reads one version of the tree without
+ * taking a lock.
  * */
-void RBtree::transplant(Node *n1, Node *n2) {
-    if (n1->parent == nil) {
-        root = n2;
-    } else if (n1 == n1->parent->left) {
-        n1->parent->left = n2;
-    } else {
-        n1->parent->right = n2;
+void run_persistent_query(const Command &c) {
+    if (c.op == SEARCH) {
+        add_result(c, persistent->search(c.key), 0);
+    } else if (c.op == RANK) {
+        add_result(c, persistent->rank(c.key), 0);
+    } else if (c.op == SELECT) {
+        int key = 0;
+        bool found = persistent->select(c.key, key);
+        add_result(c, key, found);
+    } else if (c.op == RANGE_COUNT) {
+        add_result(c, persistent->range_count(c.key, c.key2), 0);
+    } else if (c.op == RANGE) {
+        vector<int> &keys = my_log->keys;
+        size_t first = keys.size();
+        persistent->scan(c.key, c.key2, [&](const Node<int> *n) {
+            keys.push_back(n->key);
+        });
+        add_result(c, first, keys.size() - first);
     }
-    n2->parent = n1->parent;
 }
 
 /**
- * delete_node_fixup is a helper method that ensures the properties of the red black tree are maintained during deletion.
+ * run_query_batch runs a batch of commands that only read the tree and adds their results to the log of the calling
+ * thread, in order. The searches of the batch are answered together by search_batch, or by the frozen index, under a
+ * single shared hold of the tree lock; the other commands, and every command of a sharded tree or of one in path
+ * copying mode, go through run_query one at a time.
  * */
-void RBtree::delete_node_fixup(Node *n) {
-    Node *tmp = NULL;
-    while (n != root && n->color == false) {
-        if (n == n->parent->left) {
-            tmp = n->parent->right;
-            if (tmp->color) {
-                tmp->color = false;
-                n->parent->color = true;
-                left_rotate(n->parent);
-                tmp = n->parent->right;
+void run_query_batch(const vector<Command> &batch) {
+    vector<int> keys;
+    bool locked = sharded == NULL && persistent == NULL;
+    if (locked) {
+        for (size_t i=0; i<batch.size(); i++) {
+            if (batch[i].op == SEARCH) {
+                keys.push_back(batch[i].key);
             }
-            if (tmp->left->color == false && tmp->right->color == false) {
-                tmp->color = true;
-                n = n->parent;
-            } else {
-                if (!tmp->right->color) {
-                    tmp->left->color = false;
-                    tmp->color = true;
-                    right_rotate(tmp);
-                    tmp = n->parent->right;
-                }
-                tmp->color = n->parent->color;
-                n->parent->color = false;
-                tmp->right->color = false;
-                left_rotate(n->parent);
-                n = root;
+        }
+    }
+    bool *found = new bool[keys.size()];
+    if (!keys.empty()) {
+        RB_STAT(unsigned long t0 = now_ns();)
+        tree_lock.lock_shared();
+        RB_STAT(unsigned long t1 = now_ns(); my_stats->lock_wait_ns += t1 - t0; my_stats->lock_acquisitions++;)
+        if (frozen != NULL) {
+            for (size_t i=0; i<keys.size(); i++) {
+                found[i] = frozen->search(tree, keys[i], pending_modifications == 0);
             }
         } else {
-            tmp = n->parent->left;
-            if (tmp->color) {
-                tmp->color = false;
-                n->parent->color = true;
-                right_rotate(n->parent);
-                tmp = n->parent->left;
-            }
-            if (tmp->right->color == false && tmp->left->color == false) {
-                tmp->color = true;
-                n = n->parent;
-            } else {
-                if (!tmp->left->color) {
-                    tmp->right->color = false;
-                    tmp->color = true;
-                    left_rotate(tmp);
-                    tmp = n->parent->left;
-                }
-                tmp->color = n->parent->color;
-                n->parent->color = false;
-                tmp->left->color = false;
-                right_rotate(n->parent);
-                n = root;
-            }
+            tree->search_batch(keys.data(), keys.size(), found);
+        }
+        RB_STAT(my_stats->lock_hold_ns += now_ns() - t1;)
+        tree_lock.unlock_shared();
+    }
+    size_t j = 0;
+    for (size_t i=0; i<batch.size(); i++) {
+        if (batch[i].op == SEARCH && locked) {
+            add_result(batch[i], found[j++], 0);
+        } else {
+            run_query(batch[i]);
         }
-        n->color = false;
     }
+    delete[] found;
 }
 
 /**
- * insert_fixup is a helper method that ensures the properties of the red black tree are maintained during insertion.
+ * reader is the function that the search threads run in. It takes the thread_id as input and keeps running the search
+ * at the front of the search_queue until the queue is drained and the whole input has been parsed. In batched mode it
+ * takes up to batch_size queries at once and runs them together.
  * */
-void RBtree::insert_fixup(Node *n) {
-    Node *tmp = NULL;
-    while (n->parent->color) {
-        //n's parent is a left child
-        if (n->parent == n->parent->parent->left) {
-            tmp = n->parent->parent->right;
-            //case 1: n's parent's parent's right child is red; n's parent is red, but does not have 2 black children
-            if (tmp->color) {
-                n->parent->color = false;
-                tmp->color = false;
-                n->parent->parent->color = true;
-                n = n->parent->parent;
-                //n's parent's parent's right child is black
-            } else {
-                //case 2: n is a right child
-                if (n == n->parent->right) {
-                    n = n->parent;
-                    left_rotate(n);
-                }
-                //case 3: red node with a red child
-                n->parent->color = false;
-                n->parent->parent->color = true;
-                right_rotate(n->parent->parent);
-            }
-            //n's parent is a right child
-        } else {
-            tmp = n->parent->parent->left;
-            //case 1: n's parent's parent's left child is red; n's parent is red, but does not have 2 black children
-            if (tmp->color) {
-                n->parent->color = false;
-                tmp->color = false;
-                n->parent->parent->color = true;
-                n = n->parent->parent;
-                ////n's parent's parent's left child is black
-            } else {
-                //case 2: n is a left child
-                if (n == n->parent->left) {
-                    n = n->parent;
-                    right_rotate(n);
-                }
-                //case 3: red node with a red child
-                n->parent->color = false;
-                n->parent->parent->color = true;
-                left_rotate(n->parent->parent);
-            }
-        }
+void *(reader)(void *arg) {
+	RB_STAT(my_stats = &thread_stats[(long) arg];)
+	my_log = &result_logs[(long) arg];
+	vector<Command> batch;
+	while (true) {
+		//take the next search off the queue, or up to batch_size of them, waiting for the parser if it is behind
+		unique_lock<mutex> lk(x);
+		RB_STAT(unsigned long t0 = now_ns();)
+		while (search_queue.empty() && !parsing_done) {
+			work_ready.wait(lk);
+		}
+		RB_STAT(my_stats->queue_wait_ns += now_ns() - t0;)
+		if (search_queue.empty()) {
+			break;
+		}
+		batch.clear();
+		do {
+			batch.push_back(search_queue.front());
+			search_queue.pop();
+		} while (batch.size() < batch_size && !search_queue.empty());
+		space_ready.notify_one();
+		lk.unlock();
+		RB_STAT(for (size_t i=0; i<batch.size(); i++) my_stats->ops[batch[i].op]++;)
+		if (batch.size() > 1) {
+			run_query_batch(batch);
+		} else {
+			run_query(batch[0]);
+		}
+		if ((pending_searches -= batch.size()) == 0) {
+			lock_guard<mutex> lk(x);
+			work_ready.notify_all();
+		}
+	}
+	return NULL;
+}
+
+/**
+ * extends_run returns true if the insert c continues the run of inserts in run, whose keys all go up or all go down.
+ * */
+bool extends_run(const vector<Command> &run, const Command &c) {
+    const Command &last = run.back();
+    if (c.op != INSERT || last.op != INSERT) {
+        return false;
+    }
+    if (run.size() == 1) {
+        return true;
     }
-    //make the root black
-    root->color = false;
+    bool ascending = run[0].key <= run[1].key;
+    return ascending ? last.key <= c.key : last.key >= c.key;
 }
 
 /**
- * left_rotate performs a left rotation on the node n and its children
+ * log_commands appends the n inserts and deletes at c to the write-ahead log. Modifications of one key must be logged
+ * in the order they are applied, so it is called under the lock that orders them.
  * */
-void RBtree::left_rotate(Node *n) {
-    Node *tmp = n->right;
-    n->right = tmp->left;
-    if (tmp->left != nil) {
-        tmp->left->parent = n;
-    }
-    tmp->parent = n->parent;
-    if (n->parent == nil) {
-        root = tmp;
-    } else if (n == n->parent->left) {
-        n->parent->left = tmp;
-    } else {
-        n->parent->right = tmp;
+void log_commands(const Command *c, size_t n) {
+    static thread_local vector<LogRecord<int> > records;
+    records.resize(n);
+    for (size_t i=0; i<n; i++) {
+        records[i].op = c[i].op == INSERT ? LOG_INSERT : LOG_DELETE;
+        records[i].key = c[i].key;
     }
-    tmp->left = n;
-    n->parent = tmp;
+    wal->append(records.data(), n);
 }
 
 /**
- * right_rotate performs a right rotation on the node n and its children
+ * compact_log compacts the write-ahead log into a snapshot of the tree if it has grown enough. Searches go on while
+ * the snapshot is written, but modifications wait for it. With shards the log is only compacted at the end.
  * */
-void RBtree::right_rotate(Node *n) {
-    Node *tmp = n->left;
-    n->left = tmp->right;
-    if (tmp->right != nil) {
-        tmp->right->parent = n;
-    }
-    tmp->parent = n->parent;
-    if (n->parent == nil) {
-        root = tmp;
-    } else if (n == n->parent->right) {
-        n->parent->right = tmp;
+void compact_log() {
+    if (!wal->should_compact()) {
+        return;
+    }
+    //the snapshot and the log have to be cut at the same modification; a failed compaction keeps the old log
+    int failed;
+    if (persistent != NULL) {
+        lock_guard<mutex> order(log_order);
+        RBtree<int> *copy = persistent->snapshot();
+        failed = wal->compact(copy);
+        delete copy;
     } else {
-        n->parent->left = tmp;
+        //modifications are logged under the exclusive lock, so none can come in while it is held shared
+        tree_lock.lock_shared();
+        failed = wal->compact(tree);
+        tree_lock.unlock_shared();
+    }
+    if (failed) {
+        perror("log compaction");
     }
-    tmp->right = n;
-    n->parent = tmp;
 }
 
 /**
- * in_order_print is a recursive function to print the tree in order from the input node n
+ * writer is the function that the modify threads run in. It takes the thread_id as input and keeps running the modification
+ * at the front of the modify_queue until the queue is drained and the whole input has been parsed. A modification only
+ * starts once every search queued so far has finished. A run of inserts with ascending or descending keys at the front
+ * of the queue is taken and applied together, each insert starting from the node of the one before. In combining mode
+ * the thread instead takes every modification waiting in the queue and applies them sorted by key under a single hold
+ * of the tree lock, merging the inserts of the keys the batch does not delete in with RBtree::bulk_insert.
  * */
-void RBtree::preorder_print(Node *n, ofstream& out) {
-    if (n == nil) {
-        out << ",f";
-        return;
+void *(writer)(void *arg) {
+	RB_STAT(my_stats = &thread_stats[(long) arg];)
+	my_log = &result_logs[(long) arg];
+	vector<Command> batch;
+	while (true) {
+		//one combiner at a time, so batches are applied in the order they were queued
+		unique_lock<mutex> combiner(combine_lock, defer_lock);
+		if (combining) {
+			combiner.lock();
+		}
+		//take the next modification off the queue, or all of them when combining, waiting for the parser if it is behind
+		//and, when searches are preferred, for every search queued before it
+		unique_lock<mutex> lk(x);
+		while ((modify_queue.empty() && !parsing_done) || (scheduling == READER_PREFERRING && pending_searches > 0)) {
+			RB_STAT(bool for_searches = !modify_queue.empty() || parsing_done; unsigned long t0 = now_ns();)
+			work_ready.wait(lk);
+			RB_STAT((for_searches ? my_stats->search_wait_ns : my_stats->queue_wait_ns) += now_ns() - t0;)
+		}
+		if (modify_queue.empty()) {
+			break;
+		}
+		batch.clear();
+		do {
+			batch.push_back(modify_queue.front());
+			modify_queue.pop();
+		} while (!modify_queue.empty() && (combining || (batch.size() < PARSE_BATCH && extends_run(batch, modify_queue.front()))));
+		space_ready.notify_all();
+		lk.unlock();
+		if (combining) {
+			//neighbouring keys share most of their search path; the sort is stable so the commands on one key keep their order
+			stable_sort(batch.begin(), batch.end(), [](const Command &a, const Command &b) {
+				return a.key < b.key;
+			});
+		}
+		RB_STAT(for (size_t i=0; i<batch.size(); i++) my_stats->ops[batch[i].op]++;)
+		//modify
+		if (persistent != NULL) {
+			unique_lock<mutex> order(log_order, defer_lock);
+			if (wal != NULL) {
+				order.lock();
+				log_commands(batch.data(), batch.size());
+			}
+			//searches go on reading the versions before each one
+			for (size_t i=0; i<batch.size(); i++) {
+				if (batch[i].op == INSERT) {
+					persistent->insert(batch[i].key);
+				} else {
+					persistent->delete_node(batch[i].key);
+				}
+			}
+		} else if (sharded != NULL) {
+			//only the shard that owns the key is locked
+			for (size_t i=0; i<batch.size(); i++) {
+				const Command &c = batch[i];
+				sharded->modify(c.key, [&c](RBtree<int> *t) {
+					if (c.op == INSERT) {
+						t->insert(c.key);
+					} else {
+						t->delete_node(c.key);
+					}
+					if (wal != NULL) {
+						log_commands(&c, 1);
+					}
+				});
+			}
+		} else {
+			RB_STAT(unsigned long t0 = now_ns();)
+			tree_lock.lock();
+			RB_STAT(unsigned long t1 = now_ns(); my_stats->lock_wait_ns += t1 - t0; my_stats->lock_acquisitions++;)
+			if (frozen != NULL) {
+				frozen->reclaim();
+			}
+			//each insert starts looking for its place from the node inserted before it
+			Node<int> *hint = NULL;
+			//commands on different keys commute, so a sorted batch can insert the keys it never deletes all at once
+			vector<int> bulk;
+			for (size_t i=0; i<batch.size(); i++) {
+				if (combining) {
+					size_t j = i;
+					while (j < batch.size() && batch[j].key == batch[i].key && batch[j].op == INSERT) {
+						j++;
+					}
+					if (j == batch.size() || batch[j].key != batch[i].key) {
+						for (; i<j; i++) {
+							bulk.push_back(batch[i].key);
+						}
+						i--;
+						continue;
+					}
+				}
+				if (batch[i].op == INSERT) {
+					hint = tree->insert_hint(hint, batch[i].key);
+				}
+				else if (batch[i].op == DELETE) {
+					tree->delete_node(batch[i].key);
+					//the hint may have been deleted
+					hint = NULL;
+				}
+			}
+			if (bulk.size() >= BULK_INSERT_MIN) {
+				tree->bulk_insert(bulk);
+			} else {
+				for (size_t i=0; i<bulk.size(); i++) {
+					hint = tree->insert_hint(hint, bulk[i]);
+				}
+			}
+			if (wal != NULL) {
+				log_commands(batch.data(), batch.size());
+			}
+			RB_STAT(my_stats->lock_hold_ns += now_ns() - t1;)
+			tree_lock.unlock();
+		}
+		if (wal != NULL && sharded == NULL) {
+			compact_log();
+		}
+		pending_modifications -= batch.size();
+		for (size_t i=0; i<batch.size(); i++) {
+			add_result(batch[i], 0, 0);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * create_threads creates the pool of search and modify threads specified by the input integers search_threads and
+ * modify_threads. The threads start working on the queues right away while the commands are still being parsed.
+ * */
+void create_threads(int search_threads, int modify_threads) {
+    //every queue needs at least one thread to drain it
+    if (search_threads < 1) {
+        search_threads = 1;
     }
-    char col = 'b';
-    if (n->color) {
-        col = 'r';
+    if (modify_threads < 1) {
+        modify_threads = 1;
     }
-    if (n != root) {
-        out << ",";
+    int num_threads = search_threads + modify_threads;
+    workers.resize(num_threads);
+    RB_STAT(thread_stats.assign(num_threads, ThreadStats());)
+    //each thread only ever appends to its own log, so the logs need no lock
+    result_logs = vector<ResultLog>(num_threads);
+    for (int i=0; i<num_threads; i++) {
+        result_logs[i].thread = i;
+        result_logs[i].results.reserve(RESULT_LOG_RESERVE);
+    }
+    //create the reader threads
+    for (long i=0; i<search_threads; i++) {
+		pthread_create(&workers[i], NULL, reader, (void *)i);
     }
-    out << n->key << col;
-    preorder_print(n->left, out);
-    preorder_print(n->right, out);
+    //create the writer threads
+    for (long j=search_threads; j<num_threads; j++) {
+		pthread_create(&workers[j], NULL, writer, (void *)j);
+	}
 }
 
 /**
- * create_tree_helper is a recursive function that adds the nodes to the tree in preorder as they're listed.  It takes in a pointer to 
- * the tree, a vector containing the keys in preorder, a vector containing the colors in preorder, and a pointer to the index sharer
- * by the recursive calls of the function. It returns a pointer to the root of the tree.
+ * join_threads tells the pool that no more commands are coming and waits for it to drain the queues and exit.
  * */
-Node * create_tree_helper(RBtree *t, vector<int> keys, vector<char> cols, int *index_ptr) {
-    int index = *index_ptr;
-    //check if the node is a leaf. If we haven't reached the end of the vectors, increment the pointer
-    if (cols[index] == 'f') {
-        if (index < keys.size()-1) {
-            (*index_ptr)++;
-        }
-        return t->nil;
-    }
-    Node *temp = new Node();
-    temp->key = keys[index];
-    if (cols[index] == 'r') {
-        temp->color = true;
-    } else {
-        temp->color = false;
-    }
-    (*index_ptr)++;
-    //recursively create the node's children.
-    temp->left = create_tree_helper(t, keys, cols, index_ptr);
-    temp->left->parent = temp;
-    temp->right = create_tree_helper(t, keys, cols, index_ptr);
-    temp->right->parent = temp;
-    return temp;
+void join_threads() {
+    x.lock();
+    parsing_done = true;
+    x.unlock();
+    work_ready.notify_all();
+    for (size_t k=0; k<workers.size(); k++) {
+        pthread_join(workers[k], NULL);
+    }
+    workers.clear();
 }
 
 /**
- * create_tree takes in a vector of strings that contains the nodes of the tree as inputted by the input file.
- * After separating the keys and the colors, it calls create_tree_helper to add the nodes to the tree.
- * Returns a pointer to the tree.
+ * enqueue_commands adds a batch of parsed commands to their queues, waiting while the queues are full, and wakes up
+ * the threads that are waiting for work.
  * */
-RBtree * create_tree(vector<string> nodes) {
-    RBtree *tree = new RBtree();
-    //if the tree is null
-    if (nodes[0] == "NULL" || nodes[0] == "null" || nodes[0] == "f") {
-        return tree;
-    }
-    vector<int> values;
-    vector<char> colors;
-    //separate the node values from the colors
-    for (int i=0; i<nodes.size(); i++) {
-        //if the value is just 'f', push -1 so we know it's a nil node
-        if (nodes[i].length() != 1) {
-            values.push_back(stoi(nodes[i]));
+void enqueue_commands(const vector<Command> &batch) {
+    unique_lock<mutex> lk(x);
+    while (search_queue.size() + modify_queue.size() >= QUEUE_LIMIT) {
+        space_ready.wait(lk);
+    }
+    for (size_t k=0; k<batch.size(); k++) {
+        if (batch[k].op != INSERT && batch[k].op != DELETE) {
+            search_queue.push(batch[k]);
+            pending_searches++;
         } else {
-            values.push_back(-1);
+            modify_queue.push(batch[k]);
+            pending_modifications++;
         }
-        colors.push_back(nodes[i].back());
     }
-    //add the tree nodes
-    int index = 0;
-    tree->root = create_tree_helper(tree, values, colors, &index);
-    tree->root->parent = tree->nil;
-    return tree;
+    lk.unlock();
+    work_ready.notify_all();
 }
+
 /**
- * reader is the function that the search threads run in. It takes the thread_id as input and runs the function at the beginning
- * of the search_queue once signaled that it can begin
+ * parse_command reads the next command, such as "insert(80)", starting at p and stopping at end. Commands are separated
+ * by " || " and may span several lines. It advances p past the command and fills in c.
+ * Returns false once there are no more commands.
  * */
-void *(reader)(void *arg) {
-	//wait for main thread to finish creating all threads
-	while (!done) {;}
-	if (!search_queue.empty()) {
-		rsem.lock();	
-		//search
-		int num = search_queue.front();
-        bool s = tree->search(num);
-        string tf;
-        if (s) {
-            tf = "true";
-        } else {
-            tf = "false";
+bool parse_command(const char *&p, const char *end, Command &c) {
+    while (true) {
+        //skip separators and blank space
+        while (p < end && (*p == ' ' || *p == '|' || *p == '\n' || *p == '\r' || *p == '\t')) {
+            p++;
         }
-        string result = "search(" + to_string(num) + ")->" + tf + ", performed by thread: " + to_string((long) arg);
-        thread_results.push_back(result);
-		search_queue.pop();
-	}
-	//check if there are any more readers, otherwise signal writers		
-	if (!search_queue.empty()) {	
-		rsem.unlock();
-	}
-	else {
-		wsem.unlock();
-	}
-	return NULL;
+        if (p >= end) {
+            return false;
+        }
+        const char *name = p;
+        while (p < end && *p != '(') {
+            p++;
+        }
+        if (p >= end) {
+            return false;
+        }
+        const char *name_end = p;
+        while (name_end > name && name_end[-1] == ' ') {
+            name_end--;
+        }
+        //skip "(" and read the comma separated integer arguments
+        p++;
+        long args[2] = {0, 0};
+        for (int a=0; a<2 && p < end && *p != ')'; a++) {
+            while (p < end && *p == ' ') {
+                p++;
+            }
+            bool neg = false;
+            if (p < end && *p == '-') {
+                neg = true;
+                p++;
+            }
+            long num = 0;
+            while (p < end && *p >= '0' && *p <= '9') {
+                num = num * 10 + (*p - '0');
+                p++;
+            }
+            args[a] = neg ? -num : num;
+            while (p < end && *p != ',' && *p != ')') {
+                p++;
+            }
+            if (p < end && *p == ',') {
+                p++;
+            }
+        }
+        while (p < end && *p != ')') {
+            p++;
+        }
+        p++;
+        c.key = (int) args[0];
+        c.key2 = (int) args[1];
+        //look the name up; unknown commands are skipped
+        size_t len = name_end - name;
+        for (int t=0; t<NUM_COMMANDS; t++) {
+            if (strlen(command_names[t]) == len && memcmp(command_names[t], name, len) == 0) {
+                c.op = (CommandType) t;
+                return true;
+            }
+        }
+    }
 }
 
 /**
- * writer is the function that the modify threads run in. It takes the thread_id as input and runs the function at the beginning
- * of the modify_queue once signaled that it can begin
+ * next_line returns the line starting at p and moves p to the start of the following line.
  * */
-void *(writer)(void *arg) {
-	//wait for main thread to finish creating all threads
-	while (!done) {;}
-	while (!search_queue.empty()) {;}
-	wsem.lock();
-	//modify
-	if (!modify_queue.empty()) {
-		string com = modify_queue.front();
-		modify_queue.pop();
-		string letter = com.substr(0, 1);
-		com.erase(0, 1);
-		int num = stoi(com);
-		if (letter == "i") {
-			tree->insert(num);
-            string result = "insert(" + to_string(num) + "), performed by thread: " + to_string((long)arg);
-            thread_results.push_back(result);
-		}
-		else if (letter == "d") {
-			tree->delete_node(num);
-            string result = "delete(" + to_string(num) + "), performed by thread: " + to_string((long)arg);
-            thread_results.push_back(result);
-		}
-	}
-    wsem.unlock();
-	return NULL;
+static string next_line(const char *&p, const char *end) {
+    const char *start = p;
+    while (p < end && *p != '\n') {
+        p++;
+    }
+    string line(start, p);
+    if (p < end) {
+        p++;
+    }
+    return line;
 }
 
 /**
- * create_threads creates the search and modify threads specified by the input integers search_threads and modify_threads
- * it then parses commands and inputs for the search and modify commands and adds them to their respective queues in order
- * to be executed by the appropriate threads.
+ * parse_policy sets policy to the RWPolicy named in name, ignoring blank space around it.
+ * Returns 1 if no policy has that name.
  * */
-void RBtree::create_threads(int search_threads, int modify_threads, vector<string> commands, vector<int> inputs) {
-    //fill the queues from the commands
-    for (int k=0; k<commands.size(); k++) {
-        if (commands[k] == "s") {
-            search_queue.push(inputs[k]);
-        } else {
-            modify_queue.push(commands[k]+" "+to_string(inputs[k]));
+int parse_policy(const string &name, RWPolicy &policy) {
+    size_t first = name.find_first_not_of(" \t\r");
+    size_t last = name.find_last_not_of(" \t\r");
+    if (first == string::npos) {
+        return 1;
+    }
+    string trimmed = name.substr(first, last - first + 1);
+    for (int i=0; i<NUM_POLICIES; i++) {
+        if (trimmed == policy_names[i]) {
+            policy = (RWPolicy) i;
+            return 0;
         }
     }
-    int num_threads = search_threads + modify_threads;
-    pthread_t threads[num_threads];
-    //create the reader threads
-    for (int i=0; i<search_threads; i++) {
-		pthread_create(&threads[i], NULL, reader, (void *)i);
+    return 1;
+}
+
+/**
+ * shard_sample returns keys to pick the shard bounds with besides the keys of the tree: the keys inserted by the first
+ * SHARD_SAMPLE commands starting at p, and if the tree and those keys together still have fewer than num_shards
+ * distinct keys, keys spread evenly over the whole int range.
+ * */
+vector<int> shard_sample(const char *p, const char *end, RBtree<int> *t) {
+    vector<int> sample;
+    Command c;
+    for (int i=0; i<SHARD_SAMPLE && parse_command(p, end, c); i++) {
+        if (c.op == INSERT) {
+            sample.push_back(c.key);
+        }
     }
-    //create the writer threads
-    for (int j=search_threads; j<num_threads; j++) {
-		pthread_create(&threads[j], NULL, writer, (void *)j);
-	}
-	done = true;
+    vector<int> distinct(sample);
+    for (RBtree<int>::iterator it = t->begin(); it != t->end() && (int) distinct.size() <= 2 * num_shards; ++it) {
+        distinct.push_back(*it);
+    }
+    sort(distinct.begin(), distinct.end());
+    if (unique(distinct.begin(), distinct.end()) - distinct.begin() < num_shards) {
+        //nothing tells where the keys will go, so every shard gets the same share of the ints
+        for (int i=0; i<num_shards; i++) {
+            sample.push_back((int) (INT32_MIN + (4294967296LL * i) / num_shards));
+        }
+    }
+    return sample;
+}
+
+/**
+ * close_log syncs the records still waiting in the write-ahead log, if there is one, and closes it.
+ * */
+void close_log() {
+    delete wal;
+    wal = NULL;
 }
 
 /**
  * read_file parses the input file for the tree nodes, thread information, and function calls.
+ * The file is memory mapped and the commands are scanned in place and handed to the threads in batches,
+ * so the threads work while the rest of the file is still being parsed. With a write-ahead log that is not empty,
+ * the tree comes from the log and the commands of the file are not run again.
  * Returns 1 if an error occurs while opening or reading the file.
  * */
 int read_file(char *filename) {
-    ifstream file(filename);
-    string line, line2, line3;
-    //separate the line into the nodes' information
-    vector<string> nodes;
-    getline(file, line);
-    string del = ",";
-    string tok;
-    size_t pos = 0;
-    while ((pos = line.find(del)) != string::npos) {
-        tok = line.substr(0, pos);
-        nodes.push_back(tok);
-        line.erase(0, pos + del.length());
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return 1;
     }
-    tree = create_tree(nodes);
+    size_t len = st.st_size;
+    void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 1;
+    }
+    madvise(data, len, MADV_SEQUENTIAL);
+    const char *p = (const char *) data;
+    const char *end = p + len;
+    //build the tree from the nodes' information, which is the whole first line
+    const char *first = p;
+    while (p < end && *p != '\n') {
+        p++;
+    }
+    string log_snapshot;
+    if (log_path != NULL) {
+        wal = new WriteAheadLog<int>(log_path, log_group_size, log_group_interval);
+        if (wal->open_log()) {
+            munmap(data, len);
+            close_log();
+            return 1;
+        }
+        log_snapshot = wal->snapshot_path();
+    }
+    if (!log_snapshot.empty()) {
+        //a compacted log goes on top of its own snapshot
+        tree = new RBtree<int>(true);
+        if (tree->load(log_snapshot.c_str())) {
+            munmap(data, len);
+            close_log();
+            return 1;
+        }
+    } else if (load_path != NULL) {
+        //the tree comes from the snapshot instead
+        tree = new RBtree<int>(true);
+        if (tree->load(load_path)) {
+            munmap(data, len);
+            close_log();
+            return 1;
+        }
+    } else {
+        tree = create_tree(first, p - first);
+    }
+    //bring the tree up to the last modification that reached the log
+    if (wal != NULL && wal->replay(tree)) {
+        munmap(data, len);
+        close_log();
+        return 1;
+    }
+    //the modifications of the input file already went into the log on an earlier run
+    bool resumed = wal != NULL && !wal->empty();
+    if (p < end) {
+        p++;
+    }
+    string line;
+    size_t pos = 0;
     int search, modify;
     //ignore blank space
-    getline(file, line);
+    next_line(p, end);
     //get num of search threads
-    getline(file, line);
-    del = ":";
-    pos = line.find(del);
-    search = stoi(line.substr(pos+1, line.length()-2));
+    line = next_line(p, end);
+    pos = line.find(":");
+    search = atoi(line.c_str() + pos + 1);
     //get num of modify threads
-    getline(file, line);
-    pos = line.find(del);
-    modify = stoi(line.substr(pos+1, line.length()-2));
-    //ignore blank space
-    getline(file, line);
-    //get commands
-    del = " || ";
-    vector<string> com;
-    vector<int> input;
-	string last_line;
-    int pos1, pos2;
-    while (getline(file, line)) {
-        while ((pos = line.find(del)) != string::npos) {
-            tok = line.substr(0, pos);
-            com.push_back(tok.substr(0,1));
-            pos1 = tok.find("(");
-            pos2 = tok.find(")");
-			int n = stoi(line.substr(pos1+1, pos2));
-            input.push_back(n);
-            line.erase(0, pos + del.length());
-        }
-		last_line = line;
-    } 
-	com.push_back(last_line.substr(0, 1));
-    pos1 = last_line.find("(");
-    pos2 = last_line.find(")");
-	int n = stoi(last_line.substr(pos1+1, pos2));
-    input.push_back(n);
-
-    //create the threads
-    tree->create_threads(search, modify, com, input);
+    line = next_line(p, end);
+    pos = line.find(":");
+    modify = atoi(line.c_str() + pos + 1);
+    //an optional line picks how searches and modifications share the tree
+    const char *q = p;
+    line = next_line(q, end);
+    if (line.compare(0, 10, "Scheduling") == 0) {
+        p = q;
+        if (parse_policy(line.substr(line.find(":") + 1), scheduling)) {
+            munmap(data, len);
+            close_log();
+            return 1;
+        }
+    }
+    tree_lock.set_policy(scheduling);
+    if (resumed) {
+        //running the commands again would apply them twice
+        p = end;
+        fprintf(stderr, "Warning: the commands of %s were not run, the tree was rebuilt from the log %s\n", filename,
+                log_path);
+    }
+    //the blank space before the commands is skipped by parse_command
+
+    if (num_shards > 1) {
+        sharded = new ShardedRBtree<int>(tree, num_shards, shard_sample(p, end, tree));
+        if ((int) sharded->shards.size() < num_shards) {
+            fprintf(stderr, "Warning: only %d of %d shards, the tree has too few distinct keys\n",
+                    (int) sharded->shards.size(), num_shards);
+        }
+        for (size_t i=0; i<sharded->shards.size(); i++) {
+            sharded->shards[i]->lock.set_policy(scheduling);
+        }
+        delete tree;
+        tree = NULL;
+    } else if (path_copying) {
+        persistent = new PersistentRBtree<int>(tree);
+        delete tree;
+        tree = NULL;
+    }
+    //create the threads, then feed them the commands as they are parsed
+    create_threads(search, modify);
+    vector<Command> batch;
+    batch.reserve(PARSE_BATCH);
+    Command c;
+    while (parse_command(p, end, c)) {
+        batch.push_back(c);
+        if (batch.size() == PARSE_BATCH) {
+            enqueue_commands(batch);
+            batch.clear();
+        }
+    }
+    enqueue_commands(batch);
+    if (serve_path != NULL && serve(serve_path)) {
+        join_threads();
+        munmap(data, len);
+        close_log();
+        return 1;
+    }
+    join_threads();
+    delete frozen;
+    frozen = NULL;
+    if (sharded != NULL) {
+        //put the shards back together for the output
+        tree = sharded->merge();
+        delete sharded;
+        sharded = NULL;
+    }
+    if (persistent != NULL) {
+        //the last version, as it is, for the output
+        tree = persistent->snapshot();
+        delete persistent;
+        persistent = NULL;
+    }
+    munmap(data, len);
+    if (wal != NULL) {
+        //keep what the next run replays short
+        if (wal->should_compact() && wal->compact(tree)) {
+            close_log();
+            return 1;
+        }
+        close_log();
+    }
     write_file(tree);
+    if (save_path != NULL && tree->save(save_path)) {
+        return 1;
+    }
     return 0;
 }
 
 /**
  * write_file prints the specified output to an output file "out.txt". It prints the execution time, the results of the
- * function calls and which thread ran them, as well as the final red black tree.
+ * function calls and which thread ran them, as well as the final red black tree, which can instead be written to its
+ * own file or skipped.
  * */
-void write_file(RBtree *t) {
+void write_file(RBtree<int> *t) {
     ofstream out("out.txt");
 	complete = chrono::high_resolution_clock::now();
-	double time_span = chrono::duration_cast<chrono::microseconds>(complete - start).count();
+	double time_span = chrono::duration<double, milli>(complete - start).count();
     out << "Execution time: " << to_string(time_span) << " ms" << endl;
     out << endl;
-    for (int i=0; i<thread_results.size(); i++) {
-        out << thread_results[i] << endl;
+    write_results(out);
+    RB_STAT(write_stats(out, t);)
+    if (skip_dump) {
+        return;
+    }
+    if (dump_path != NULL) {
+        ofstream dump(dump_path);
+        t->preorder_print(t->root, dump);
+        dump << endl;
+        return;
     }
     out << endl;
     t->preorder_print(t->root, out);
 	out << endl;
 }
 
+/**
+ * format_result appends the result r to line as it is written in out.txt, such as "search(80)->true". keys points to
+ * the keys found by a range command.
+ * */
+void format_result(string &line, const Result &r, const int *keys) {
+    const Command &c = r.c;
+    line += command_names[c.op];
+    line += "(" + to_string(c.key);
+    if (c.op == RANGE_COUNT || c.op == RANGE) {
+        line += "," + to_string(c.key2);
+    }
+    line += ")";
+    if (c.op == SEARCH) {
+        line += r.outcome ? "->true" : "->false";
+    } else if (c.op == RANK || c.op == RANGE_COUNT) {
+        line += "->" + to_string(r.outcome);
+    } else if (c.op == SELECT) {
+        line += "->" + (r.length ? to_string(r.outcome) : string("none"));
+    } else if (c.op == RANGE) {
+        line += "->";
+        for (int i=0; i<r.length; i++) {
+            if (i) {
+                line += ',';
+            }
+            line += to_string(keys[i]);
+        }
+        if (r.length == 0) {
+            line += "none";
+        }
+    }
+}
+
+/**
+ * print_result prints the result r, from the log of its thread, as a line of out.txt.
+ * */
+void print_result(ofstream &out, const Result &r) {
+    string line;
+    format_result(line, r, r.c.op == RANGE ? result_logs[r.thread].keys.data() + r.outcome : NULL);
+    out << line << ", performed by thread: " << r.thread << "\n";
+}
+
+/**
+ * respond sends the answers to the requests of conn, in order, as they finish, until conn is closed and every answer
+ * has been sent.
+ * */
+void respond(Connection *conn) {
+    string out;
+    bool failed = false;
+    while (true) {
+        unique_lock<mutex> lk(conn->lock);
+        while ((conn->pending.empty() && !conn->closed) || (!conn->pending.empty() && conn->pending.front()->remaining > 0)) {
+            conn->ready.wait(lk);
+        }
+        if (conn->pending.empty()) {
+            break;
+        }
+        //every request at the front that is complete goes out in one write
+        vector<Request *> done;
+        while (!conn->pending.empty() && conn->pending.front()->remaining == 0) {
+            done.push_back(conn->pending.front());
+            conn->pending.pop();
+        }
+        lk.unlock();
+        //modifications are only confirmed once they are on disk
+        if (wal != NULL) {
+            wal->wait_durable(wal->appended());
+        }
+        out.clear();
+        for (size_t i=0; i<done.size(); i++) {
+            for (size_t j=0; j<done[i]->lines.size(); j++) {
+                out += done[i]->lines[j];
+                out += '\n';
+            }
+            out += '\n';
+            delete done[i];
+        }
+        //a client that went away still has its requests run, but gets no more answers
+        for (size_t sent=0; sent<out.size() && !failed;) {
+            ssize_t n = write(conn->out_fd, out.data() + sent, out.size() - sent);
+            if (n <= 0) {
+                failed = true;
+            } else {
+                sent += n;
+            }
+        }
+    }
+}
+
+/**
+ * serve_connection reads the requests of the client conn, hands their commands to the threads and sends back the
+ * answers until the client is done or the server shuts down. A request is handed over once the earlier requests it
+ * could see or change have finished. It sets shutdown_requested when the client sends "shutdown".
+ * */
+void serve_connection(Connection *conn) {
+    thread responder(respond, conn);
+    string buf;
+    char chunk[65536];
+    vector<Command> batch;
+    bool done = false;
+    while (!done) {
+        ssize_t n = read(conn->in_fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            break;
+        }
+        buf.append(chunk, n);
+        //every complete line is a request
+        size_t start = 0;
+        size_t nl;
+        while (!done && (nl = buf.find('\n', start)) != string::npos) {
+            const char *p = buf.data() + start;
+            const char *end = buf.data() + nl;
+            start = nl + 1;
+            //only a line that is exactly "shutdown", give or take blank space, stops the server
+            string request(p, end);
+            size_t first = request.find_first_not_of(" \t\r");
+            size_t last = request.find_last_not_of(" \t\r");
+            if (first != string::npos && request.compare(first, last - first + 1, "shutdown") == 0) {
+                shutdown_requested = true;
+                done = true;
+                break;
+            }
+            Request *req = new Request();
+            req->conn = conn;
+            Command c;
+            while (parse_command(p, end, c)) {
+                c.req = req;
+                c.slot = req->lines.size();
+                req->lines.push_back(string());
+                if (c.op == INSERT || c.op == DELETE) {
+                    req->modifies = true;
+                }
+                batch.push_back(c);
+            }
+            req->remaining = batch.size();
+            unique_lock<mutex> lk(conn->lock);
+            //the request sees the modifications of the requests before it, and they do not see its own
+            while (req->modifies ? conn->running > 0 : conn->modifying > 0) {
+                conn->ready.wait(lk);
+            }
+            //queued before any of its commands can finish, so the answers keep the order of the requests
+            conn->pending.push(req);
+            if (!batch.empty()) {
+                conn->running++;
+                if (req->modifies) {
+                    conn->modifying++;
+                }
+            }
+            lk.unlock();
+            if (batch.empty()) {
+                conn->ready.notify_all();
+            }
+            for (size_t k=0; k<batch.size(); k+=PARSE_BATCH) {
+                enqueue_commands(vector<Command>(batch.begin() + k, batch.begin() + min(batch.size(), k + PARSE_BATCH)));
+            }
+            batch.clear();
+        }
+        buf.erase(0, start);
+    }
+    conn->lock.lock();
+    conn->closed = true;
+    conn->lock.unlock();
+    conn->ready.notify_all();
+    responder.join();
+}
+
+/**
+ * serve keeps the tree and the threads running and answers the commands that clients send to the Unix domain socket
+ * at path, or that come in on the standard input when path is "-", until a client sends "shutdown" or the standard
+ * input ends. Each line is a request of commands separated by " || ", and a client may send more requests before the
+ * answers come back. The answer to a request is the result of each of its commands, one per line, followed by an empty
+ * line; requests are answered in order and answers that are ready together are sent together. The requests of a client
+ * also run in order: a request that modifies the tree starts once the earlier requests of the client have finished,
+ * and any other request once the earlier ones that modify the tree have. The commands of one request run concurrently.
+ * Returns 1 if the socket cannot be set up.
+ * */
+int serve(const char *path) {
+    //a client that hangs up must not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+    if (strcmp(path, "-") == 0) {
+        Connection conn;
+        conn.in_fd = 0;
+        conn.out_fd = 1;
+        conn.closed = false;
+        serve_connection(&conn);
+        return 0;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return 1;
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+        close(listener);
+        return 1;
+    }
+    vector<thread> handlers;
+    while (!shutdown_requested) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        clients_lock.lock();
+        //a client that connects while the server shuts down would not be woken up
+        if (shutdown_requested) {
+            clients_lock.unlock();
+            close(fd);
+            break;
+        }
+        Connection *conn = new Connection();
+        conn->in_fd = fd;
+        conn->out_fd = fd;
+        conn->closed = false;
+        clients.push_back(conn);
+        clients_lock.unlock();
+        handlers.push_back(thread([conn, listener]() {
+            serve_connection(conn);
+            clients_lock.lock();
+            clients.erase(find(clients.begin(), clients.end(), conn));
+            if (shutdown_requested) {
+                //wake up accept and every other client so the server can stop
+                shutdown(listener, SHUT_RDWR);
+                for (size_t i=0; i<clients.size(); i++) {
+                    shutdown(clients[i]->in_fd, SHUT_RD);
+                }
+            }
+            clients_lock.unlock();
+            close(conn->in_fd);
+            delete conn;
+        }));
+    }
+    for (size_t i=0; i<handlers.size(); i++) {
+        handlers[i].join();
+    }
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+/**
+ * write_results prints the results of every thread to out in the order they were produced, merging the logs of the
+ * threads by time. Results with the same time keep the order of their log, and the logs are taken by thread id.
+ * */
+void write_results(ofstream &out) {
+    //the next result of every log that still has some, earliest first
+    typedef pair<unsigned long, pair<int, size_t> > Head;
+    priority_queue<Head, vector<Head>, greater<Head> > heads;
+    for (size_t i=0; i<result_logs.size(); i++) {
+        if (!result_logs[i].results.empty()) {
+            heads.push(Head(result_logs[i].results[0].time, make_pair((int) i, (size_t) 0)));
+        }
+    }
+    while (!heads.empty()) {
+        int t = heads.top().second.first;
+        size_t k = heads.top().second.second;
+        heads.pop();
+        const vector<Result> &results = result_logs[t].results;
+        print_result(out, results[k]);
+        if (k + 1 < results.size()) {
+            heads.push(Head(results[k + 1].time, make_pair(t, k + 1)));
+        }
+    }
+}
+
+#ifdef RB_STATS
+/**
+ * write_stats prints the counters of every thread and of the tree t as a summary section of out and as JSON to the
+ * file "stats.json".
+ * */
+void write_stats(ofstream &out, RBtree<int> *t) {
+    ofstream json("stats.json");
+    int height = t->height();
+    out << endl << "Statistics:" << endl;
+    json << "{\n  \"threads\": [";
+    for (size_t i=0; i<thread_stats.size(); i++) {
+        const ThreadStats &s = thread_stats[i];
+        out << "thread " << i << ":";
+        json << (i ? "," : "") << "\n    {\"thread\": " << i << ", \"ops\": {";
+        unsigned long total = 0;
+        for (int op=0; op<NUM_COMMANDS; op++) {
+            if (s.ops[op]) {
+                out << " " << command_names[op] << " " << s.ops[op];
+            }
+            total += s.ops[op];
+            json << (op ? ", " : "") << "\"" << command_names[op] << "\": " << s.ops[op];
+        }
+        if (total == 0) {
+            out << " no commands";
+        }
+        out << ", queue wait " << s.queue_wait_ns / 1000 << " us, search wait " << s.search_wait_ns / 1000 << " us, lock wait "
+            << s.lock_wait_ns / 1000 << " us over " << s.lock_acquisitions << " acquisitions, lock hold "
+            << s.lock_hold_ns / 1000 << " us" << endl;
+        json << "}, \"queue_wait_ns\": " << s.queue_wait_ns << ", \"search_wait_ns\": " << s.search_wait_ns
+             << ", \"lock_acquisitions\": " << s.lock_acquisitions << ", \"lock_wait_ns\": " << s.lock_wait_ns
+             << ", \"lock_hold_ns\": " << s.lock_hold_ns << "}";
+    }
+    out << "tree: height " << height << ", rotations " << t->stats.rotations << ", insert fixup iterations "
+        << t->stats.insert_fixup_iterations << ", delete fixup iterations " << t->stats.delete_fixup_iterations << endl;
+    json << "\n  ],\n  \"tree\": {\"size\": " << t->size() << ", \"height\": " << height
+         << ", \"rotations\": " << t->stats.rotations << ", \"insert_fixup_iterations\": "
+         << t->stats.insert_fixup_iterations << ", \"delete_fixup_iterations\": " << t->stats.delete_fixup_iterations
+         << "}\n}\n";
+}
+#endif
+
 int main(int argc, char **argv) {
-    if (argc == 1) {
+    int opt;
+    while ((opt = getopt(argc, argv, "ol:s:t:nk:cfb:pd:w:g:i:")) != -1) {
+        switch (opt) {
+            case 'o':
+                optimistic = true;
+                break;
+            case 'l':
+                load_path = optarg;
+                break;
+            case 's':
+                save_path = optarg;
+                break;
+            case 't':
+                dump_path = optarg;
+                break;
+            case 'n':
+                skip_dump = true;
+                break;
+            case 'k':
+                num_shards = atoi(optarg);
+                break;
+            case 'c':
+                combining = true;
+                break;
+            case 'f':
+                frozen = new FrozenView<int>();
+                break;
+            case 'b':
+                batch_size = atoi(optarg) > 1 ? atoi(optarg) : 1;
+                break;
+            case 'p':
+                path_copying = true;
+                break;
+            case 'd':
+                serve_path = optarg;
+                break;
+            case 'w':
+                log_path = optarg;
+                break;
+            case 'g':
+                log_group_size = atoi(optarg) > 1 ? atoi(optarg) : 1;
+                break;
+            case 'i':
+                log_group_interval = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            default:
+                printf("Usage: %s [-o] [-c] [-f] [-p] [-b batch] [-l snapshot] [-s snapshot] [-t treefile | -n] [-k shards] [-d socket | -d -] [-w log [-g group] [-i interval]] filename\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
         printf("Please enter a filename\n");
         return 1;
     }
+    if (path_copying && num_shards > 1) {
+        //the shards are plain RBtrees with locks of their own
+        printf("-p cannot be combined with -k\n");
+        return 1;
+    }
     start = chrono::high_resolution_clock::now();
-    char *filename = argv[1];
+    char *filename = argv[optind];
     if (read_file(filename)) {
         printf("Error Reading File\n");
     }
@@ -1,26 +1,223 @@
 /**
- * rbtree.h defines two classes: Node and RBtree. It defines teh functions and variables wihtin these two classes
- * as well as some functions needed for parsing and printing to files 
+ * rbtree.h defines two class templates: Node and RBtree. It defines teh functions and variables wihtin these two classes
+ * as well as some functions needed for parsing and printing to files. The tree is a map from Key to Value ordered by
+ * Compare; the program itself uses RBtree<int>, a set of integers.
  * Author: Samantha Williams
  * November 12, 2019
  **/
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <type_traits>
+#include <new>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <vector>
 #include <queue>
+#include <string>
+#include <iterator>
+#include <atomic>
+#include <utility>
 
 #ifndef RBTREE_H_
 #define RBTREE_H_
 
 using namespace std;
+
+/**
+ * MAX_DEPTH bounds the height of any red black tree that fits in memory, which is at most 2*log2(n+1).
+ * */
+#define MAX_DEPTH 128
+
+/**
+ * QUEUE_LIMIT is the number of parsed commands that may wait in the queues before the parser waits for the threads.
+ * */
+#define QUEUE_LIMIT 65536
+
+/**
+ * PARSE_BATCH is the number of commands the parser hands to the queues at once.
+ * */
+#define PARSE_BATCH 256
+
+/**
+ * SEARCH_GROUP is the number of lookups RBtree::search_batch keeps in flight at once.
+ * */
+#define SEARCH_GROUP 16
+
+/**
+ * PARALLEL_CUTOFF is the smallest subtree size for which the set operations of RBtree hand half of their work to
+ * another thread.
+ * */
+#define PARALLEL_CUTOFF 8192
+
+/**
+ * BULK_INSERT_MIN is the smallest number of inserts a combined batch of the modify threads applies with
+ * RBtree::bulk_insert instead of one by one.
+ * */
+#define BULK_INSERT_MIN 64
+
+/**
+ * SHARD_SAMPLE is the number of commands at the start of the input whose insert keys help pick the shard bounds.
+ * */
+#define SHARD_SAMPLE 65536
+
+/**
+ * LOG_GROUP_SIZE and LOG_GROUP_INTERVAL are the defaults of -g and -i: the write-ahead log is synced once this many
+ * records wait for it, or once the oldest of them has waited this many microseconds.
+ * */
+#define LOG_GROUP_SIZE 65536
+#define LOG_GROUP_INTERVAL 10000
+
+/**
+ * CommandType lists the commands of the input language. Inserts and deletes go to the modify threads and every other
+ * command to the search threads.
+ * */
+enum CommandType {
+    SEARCH,
+    INSERT,
+    DELETE,
+    RANK,
+    SELECT,
+    RANGE_COUNT,
+    RANGE,
+    NUM_COMMANDS
+};
+
+/**
+ * command_names holds the name of each CommandType as written in the input file.
+ * */
+extern const char *command_names[NUM_COMMANDS];
+
+struct Request;
+
+/**
+ * The Command struct is one parsed command: its type and its integer arguments. Only range_count and range have a second one.
+ * */
+struct Command {
+    CommandType op;
+    int key;
+    int key2;
+    //the server request the command came in, and its place in it, or NULL for a command of the input file
+    Request *req = NULL;
+    int slot = 0;
+};
+
+/**
+ * SNAPSHOT_VERSION is the version of the binary snapshot format written by RBtree::save.
+ * */
+#define SNAPSHOT_VERSION 2
+
+/**
+ * SNAPSHOT_BUFFER is the number of keys RBtree::save collects before writing them out.
+ * */
+#define SNAPSHOT_BUFFER 65536
+
+/**
+ * PRINT_BUFFER is the number of bytes RBtree::preorder_print formats before writing them out.
+ * */
+#define PRINT_BUFFER (1 << 20)
+
+/**
+ * Flags kept for every node of a binary snapshot.
+ * */
+#define SNAPSHOT_RED 1
+#define SNAPSHOT_LEFT 2
+#define SNAPSHOT_RIGHT 4
+
+/**
+ * The SnapshotHeader struct starts every binary snapshot file. It is followed by count keys in preorder, then count
+ * mapped values in the same order unless value_size is 0, and then count flag bytes, one per node in the same order,
+ * made of SNAPSHOT_RED, SNAPSHOT_LEFT and SNAPSHOT_RIGHT.
+ * */
+struct SnapshotHeader {
+    //always "RBT" followed by a zero byte
+    char magic[4];
+    //SNAPSHOT_VERSION of the writer
+    uint16_t version;
+    //size in bytes of each key
+    uint8_t key_size;
+    //size in bytes of each mapped value; 0 for a set
+    uint8_t value_size;
+    //number of nodes in the snapshot
+    uint64_t count;
+};
+
+/**
+ * RB_STAT keeps its argument only when the program is built with RB_STATS ("make STATS=1"), so the instrumentation
+ * costs nothing in a normal build.
+ * */
+#ifdef RB_STATS
+#define RB_STAT(...) __VA_ARGS__
+#else
+#define RB_STAT(...)
+#endif
+
+/**
+ * The TreeStats struct counts the restructuring work done by one tree. It is only updated in RB_STATS builds, by the
+ * thread holding the tree exclusively.
+ * */
+struct TreeStats {
+    //calls to left_rotate and right_rotate
+    unsigned long rotations = 0;
+    //passes through the loop of insert_fixup
+    unsigned long insert_fixup_iterations = 0;
+    //passes through the loop of delete_node_fixup
+    unsigned long delete_fixup_iterations = 0;
+};
+
+/**
+ * Empty is the mapped value type of a tree that is used as a set. It takes no space in a node.
+ * */
+struct Empty {
+};
+
+/**
+ * NodeValue holds the mapped value of a node.
+ * */
+template <class Value>
+struct NodeValue {
+    //the value mapped to the node's key.
+    Value value;
+    const Value & get_value() const {
+        return value;
+    }
+    void set_value(const Value &v) {
+        value = v;
+    }
+};
+
+/**
+ * NodeValue of a set holds nothing, so as an empty base class of Node it adds no bytes to it.
+ * */
+template <>
+struct NodeValue<Empty> {
+    Empty get_value() const {
+        return Empty();
+    }
+    void set_value(const Empty &) {
+    }
+};
+
 /**
  * The Node class represents a red black tree node object.
  * */
-class Node {
+template <class Key, class Value = Empty>
+class Node : public NodeValue<Value> {
     public:
-    //the integer key value of the node.
-    int key;
+    //the key value of the node.
+    Key key;
+    //the number of nodes in the subtree rooted at the node, kept only by augmented trees; 0 for nil.
+    int size;
     //the node's parent node.
     Node *parent;
     //the node's left child node.
@@ -30,7 +227,8 @@ class Node {
     //the color of the node; true = red, false = black.
     bool color;
     //constructor for the Node class
-    Node() {
+    Node() : key() {
+        size = 0;
         parent = NULL;
         left = NULL;
         right = NULL;
@@ -38,12 +236,62 @@ class Node {
     }
 };
 
+/**
+ * NodePool hands out the nodes of one tree from large contiguous chunks and recycles deleted nodes through
+ * a free list. Every node it ever handed out is released at once when the pool is destroyed.
+ * */
+template <class N>
+class NodePool {
+    public:
+    /**
+     * allocate returns a freshly constructed node, reusing a released node when there is one.
+     * */
+    N * allocate();
+    /**
+     * release returns a node that is no longer linked into the tree to the free list.
+     * */
+    void release(N *n);
+    /**
+     * adopt takes over every chunk of other, with the nodes in them, and leaves other empty.
+     * */
+    void adopt(NodePool &other);
+    /**
+     * Constructor for the NodePool class
+     * */
+    NodePool() {
+        free_list = NULL;
+        used = CHUNK_NODES;
+    }
+    /**
+     * Destructor for the NodePool class. Frees every chunk.
+     * */
+    ~NodePool();
+    NodePool(const NodePool &) = delete;
+    NodePool & operator=(const NodePool &) = delete;
+
+    private:
+    //number of nodes carved out of each chunk
+    static const size_t CHUNK_NODES = 4096;
+    //every chunk allocated so far; nodes are carved out of the last one
+    vector<N *> chunks;
+    //released nodes, linked through their parent pointers
+    N *free_list;
+    //number of nodes already handed out from the last chunk
+    size_t used;
+};
+
 /**
  * The RBtree class defines the functions available for searching and modifying the tree.
  * It also has a pointer to the root node of the tree so that the user can access other nodes.
+ * Keys are ordered by Compare and each key maps to a Value; with the default Empty value the tree is a set.
  * */
+template <class Key, class Value = Empty, class Compare = less<Key> >
 class RBtree {
     public:
+    /**
+     * Node is the type of the nodes of this tree.
+     * */
+    typedef ::Node<Key, Value> Node;
     /**
      * root is the root of the red black tree.
      * */
@@ -53,11 +301,63 @@ class RBtree {
      * */
     Node *nil;
     /**
-    * search returns true if the input integer is present in the tree
+     * pool owns the memory of every node of the tree, including nil.
+     * */
+    NodePool<Node> pool;
+    /**
+     * comp orders the keys.
+     * */
+    Compare comp;
+    /**
+     * version is the seqlock counter of the tree. It is odd while a modification is in progress and
+     * changes every time one completes, so a lock-free reader can tell whether a writer intervened.
+     * */
+    atomic<unsigned long> version;
+    /**
+     * stats counts rotations and fixup iterations in RB_STATS builds.
+     * */
+    TreeStats stats;
+    /**
+     * augmented is true if every node keeps the size of its subtree, which rank, select, range_count and count_below
+     * need. Keeping the sizes takes a walk up to the root on every insert and delete, so a tree only does it when
+     * asked to.
+     * */
+    bool augmented;
+    /**
+    * search returns true if the input key is present in the tree
     * and false if it is not.
     * */
 
-    bool search(int num);
+    bool search(const Key &num);
+    /**
+     * find returns the node holding the input key, or nil if the key is not in the tree.
+     * Integral keys ordered by less descend without branching on the comparisons: the walk always goes down to a leaf,
+     * remembering the last node whose key was not smaller, and checks that node for equality once at the end.
+     * */
+    Node * find(const Key &num);
+    /**
+     * search_batch sets results[i] to whether keys[i] is present in the tree, for the count keys. It walks SEARCH_GROUP
+     * searches down the tree in turns, one level each, prefetching the next node of each one, so the cache misses of
+     * the different searches overlap instead of following one another.
+     * */
+    void search_batch(const Key *keys, size_t count, bool *results);
+    /**
+     * search_optimistic is a search that takes no lock. It walks the tree while writers may be modifying it and
+     * retries the walk whenever version shows that a modification overlapped it.
+     * */
+    bool search_optimistic(const Key &num);
+    /**
+     * write_begin marks the start of a modification by making version odd.
+     * */
+    void write_begin();
+    /**
+     * write_end marks the end of a modification by making version even again.
+     * */
+    void write_end();
+    /**
+     * insert_below inserts num, mapped to value, into the subtree of start, which must be where num belongs.
+     * */
+    Node * insert_below(Node *start, const Key &num, const Value &value);
     /**
      * get_minimum is a helper search function that returns the node with the smallest key value that belongs
      * to the subtree starting at node n.
@@ -67,12 +367,21 @@ class RBtree {
     * delete_node removes the node with the inputted key value from the tree
     * if it exists. It calls helper functions to maintain the red black characteristics.
     * */
-    void delete_node(int num);
+    void delete_node(const Key &num);
     /**
-    * insert inserts a new node with the given key value into the tree. It calls helper
-    * functions to maintain the red black characteristics.
+    * insert inserts a new node with the given key value, mapped to value, into the tree. It calls helper
+    * functions to maintain the red black characteristics. Returns the new node.
     * */
-    void insert(int num);
+    Node * insert(const Key &num, const Value &value = Value());
+    /**
+     * insert_hint inserts num like insert, but looks for its place starting from the node hint, typically the node
+     * inserted just before, instead of from the root. When hint holds the largest key and num is not smaller, or the
+     * smallest key and num is smaller, num goes right below hint. Otherwise it climbs from hint only until the first
+     * ancestor that bounds num on the far side and searches the subtree below it. The keys of an ascending or
+     * descending run are so placed in amortized constant time in a tree that is not augmented. A NULL or nil hint
+     * searches from the root. Returns the new node.
+     * */
+    Node * insert_hint(Node *hint, const Key &num, const Value &value = Value());
     /**
      * transplant is a helper method for deletions that changes the relationships of the nodes during deletion.
      * */
@@ -94,62 +403,2149 @@ class RBtree {
      * */
     void right_rotate(Node *n);
     /**
-     * in_order_print is a recursive function to print the tree in order from the input node n
+     * rank returns the number of keys in the tree that are smaller than num. The tree must be augmented.
+     * */
+    int rank(const Key &num);
+    /**
+     * select returns the node with the k-th smallest key, counting from 1, or nil if the tree has fewer than k keys.
+     * The tree must be augmented.
+     * */
+    Node * select(int k);
+    /**
+     * range_count returns the number of keys in the tree between lo and hi, both included. The tree must be augmented.
+     * */
+    int range_count(const Key &lo, const Key &hi);
+    /**
+     * count_below returns the number of keys in the tree smaller than num, or smaller than or equal to num if inclusive is true.
+     * The tree must be augmented.
+     * */
+    int count_below(const Key &num, bool inclusive);
+    /**
+     * size returns the number of keys in the tree: the size of the root in an augmented tree, and otherwise the number
+     * counted by walking the whole tree.
+     * */
+    int size();
+    /**
+     * successor returns the node that follows n in key order, or nil if n has the largest key.
+     * */
+    Node * successor(Node *n);
+    /**
+     * predecessor returns the node that comes before n in key order, or nil if n has the smallest key.
+     * The predecessor of nil is the node with the largest key.
+     * */
+    Node * predecessor(Node *n);
+    /**
+     * The iterator class walks the keys of the tree in order, in either direction, by following the parent links.
+     * It holds the current node and is at the end once that node is nil.
+     * */
+    class iterator {
+        public:
+        typedef bidirectional_iterator_tag iterator_category;
+        typedef Key value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const Key * pointer;
+        typedef const Key & reference;
+        //the tree being walked.
+        RBtree *tree;
+        //the current node; nil once past the largest key.
+        Node *node;
+        iterator(RBtree *t, Node *n) : tree(t), node(n) {}
+        const Key & operator*() const {
+            return node->key;
+        }
+        iterator & operator++() {
+            node = tree->successor(node);
+            return *this;
+        }
+        iterator & operator--() {
+            node = tree->predecessor(node);
+            return *this;
+        }
+        bool operator==(const iterator &other) const {
+            return node == other.node;
+        }
+        bool operator!=(const iterator &other) const {
+            return node != other.node;
+        }
+    };
+    /**
+     * begin returns an iterator at the smallest key.
+     * */
+    iterator begin();
+    /**
+     * end returns the iterator past the largest key.
+     * */
+    iterator end();
+    /**
+     * lower_bound returns an iterator at the first key that is not smaller than num.
+     * */
+    iterator lower_bound(const Key &num);
+    /**
+     * upper_bound returns an iterator at the first key that is larger than num.
+     * */
+    iterator upper_bound(const Key &num);
+    /**
+     * compute_sizes sets the size of every node of a tree that was linked together without maintaining them.
+     * */
+    void compute_sizes();
+    /**
+     * preorder_print prints the subtree of node n in preorder, with "f" for every nil leaf, the format of the first line of
+     * the input file. It walks the tree with an explicit stack and formats the keys into a large buffer that is written
+     * out in blocks.
      * */
     void preorder_print(Node *n, ofstream& out);
-	/**
-	 * create_threads creates the search and modify threads specified by the input integers search_threads and modify_threads
-	 * it then parses commands and inputs for the search and modify commands and adds them to their respective queues in order
-	 * to be executed by the appropriate threads.
-	 * */
-    void create_threads(int search_threads, int modify_threads, vector<string> commands, vector<int> inputs);
+    /**
+     * save writes the tree to the binary snapshot file filename: a SnapshotHeader followed by the keys of the nodes
+     * in preorder, their mapped values unless the tree is a set, and then one byte per node with its color and which
+     * children it has. Returns 1 if an error occurs while writing the file.
+     * */
+    int save(const char *filename);
+    /**
+     * load rebuilds the tree, which must be empty, from the binary snapshot file filename written by save.
+     * The file is memory mapped and read in a single pass.
+     * Returns 1 if an error occurs while opening or reading the file.
+     * */
+    int load(const char *filename);
+    /**
+     * height returns the number of nodes on the longest path from the root down to a leaf; 0 for an empty tree.
+     * */
+    int height();
+    /**
+     * join appends every node of other, whose keys must not be smaller than any key of this tree, and leaves other empty.
+     * */
+    void join(RBtree *other);
+    /**
+     * split moves every key that is not smaller than num into a new tree and returns it.
+     * */
+    RBtree * split(const Key &num);
+    /**
+     * set_union adds the keys of other that are not in this tree and leaves other empty. Where both trees hold a key,
+     * this tree's node and value are kept.
+     * */
+    void set_union(RBtree *other);
+    /**
+     * set_intersection removes the keys that are not in other and leaves other empty.
+     * */
+    void set_intersection(RBtree *other);
+    /**
+     * set_difference removes the keys that are in other and leaves other empty.
+     * */
+    void set_difference(RBtree *other);
+    /**
+     * merge adds every node of other, including keys that are already in this tree, and leaves other empty.
+     * */
+    void merge(RBtree *other);
+    /**
+     * bulk_insert inserts the keys, which must be in ascending order, as a balanced tree merged in with merge.
+     * */
+    void bulk_insert(const vector<Key> &keys);
+    /**
+     * snapshot_value_size is the number of bytes a snapshot stores for each mapped value; 0 for a set.
+     * */
+    static uint8_t snapshot_value_size() {
+        return is_same<Value, Empty>::value ? 0 : sizeof(Value);
+    }
+    /**
+     * Constructor for the RBtree class. An augmented tree keeps the subtree sizes of its nodes.
+     * */
+    explicit RBtree(bool augmented = false) : version(0), augmented(augmented), leftmost(NULL), rightmost(NULL),
+      extremes_version(1) {
+        nil = pool.allocate();
+        root = nil;
+        root->parent = nil;
+    }
+    RBtree(const RBtree &) = delete;
+    RBtree & operator=(const RBtree &) = delete;
+
+    private:
+    //the nodes with the smallest and largest keys, known only while extremes_version matches version; an odd value
+    //never does
+    Node *leftmost;
+    Node *rightmost;
+    unsigned long extremes_version;
+    void find_extremes();
+    long weight(Node *t);
+    //nodes dropped by the set operations, freed once the operation is over
+    vector<Node *> garbage;
+    mutex garbage_lock;
+    Node * adopt(RBtree *other);
+    Node * clone(Node *t, Node *other_nil);
+    int black_height(Node *t);
+    Node * link(Node *l, Node *k, Node *r, bool red);
+    Node * join_right(Node *l, int hl, Node *k, Node *r, int hr);
+    Node * join_left(Node *l, int hl, Node *k, Node *r, int hr);
+    Node * join_nodes(Node *l, Node *k, Node *r);
+    Node * join2_nodes(Node *l, Node *r);
+    Node * split_last(Node *t, Node *&rest);
+    void split_nodes(Node *t, const Key &num, Node *&l, Node *&r, Node **found);
+    Node * union_nodes(Node *a, Node *b, bool keep_both, int forks);
+    Node * intersect_nodes(Node *a, Node *b, int forks);
+    Node * subtract_nodes(Node *a, Node *b, int forks);
+    void discard(Node *t, bool whole);
+    void free_garbage();
+    void set_root(Node *t);
+    static int forks();
+};
 
+/**
+ * RWPolicy lists the ways an RWlock can choose between the readers and the writers waiting for it.
+ * */
+enum RWPolicy {
+    //readers get in whenever no writer holds the lock, so a steady stream of readers can starve the writers
+    READER_PREFERRING,
+    //readers wait while any writer is waiting, so a steady stream of writers can starve the readers
+    WRITER_PREFERRING,
+    //reader and writer phases alternate: a reader waits for at most one writer and a writer for the readers that
+    //came before it
+    PHASE_FAIR,
+    NUM_POLICIES
+};
 
+/**
+ * policy_names holds the name of each RWPolicy as written in the input file.
+ * */
+extern const char *policy_names[NUM_POLICIES];
 
+/**
+ * The RWlock class is a shared/exclusive lock around the tree. Any number of search threads may hold it shared
+ * at the same time while a modify thread needs it exclusively. Waiting threads sleep on a condition variable, and
+ * the policy decides whether waiting readers or waiting writers go first; readers are preferred by default.
+ * */
+class RWlock {
+    public:
     /**
-     * Constructor for the RBtree class
+     * set_policy changes the policy of the lock. The lock must not be held or waited for meanwhile.
      * */
-    RBtree() {
-        root = new Node();
-        nil = new Node();
-        root = nil;
-        root->parent = nil;
+    void set_policy(RWPolicy p) {
+        policy = p;
+    }
+    /**
+     * lock_shared blocks until the lock can be held alongside other readers.
+     * */
+    void lock_shared() {
+        unique_lock<mutex> lk(m);
+        unsigned long arrived = phase;
+        bool waited = false;
+        while (writing || (policy == WRITER_PREFERRING && writers_waiting > 0) ||
+               (policy == PHASE_FAIR && writers_waiting > 0 && phase == arrived)) {
+            readers_waiting++;
+            can_read.wait(lk);
+            readers_waiting--;
+            waited = true;
+        }
+        //a reader let in by the end of a write goes before the next writer
+        if (waited && released > 0) {
+            released--;
+        }
+        readers++;
+    }
+    /**
+     * unlock_shared releases a shared hold of the lock.
+     * */
+    void unlock_shared() {
+        lock_guard<mutex> lk(m);
+        readers--;
+        if (readers == 0 && released == 0 && writers_waiting > 0) {
+            can_write.notify_one();
+        }
+    }
+    /**
+     * lock blocks until the lock is held exclusively.
+     * */
+    void lock() {
+        unique_lock<mutex> lk(m);
+        writers_waiting++;
+        while (writing || readers > 0 || released > 0) {
+            can_write.wait(lk);
+        }
+        writers_waiting--;
+        writing = true;
+    }
+    /**
+     * unlock releases an exclusive hold of the lock.
+     * */
+    void unlock() {
+        lock_guard<mutex> lk(m);
+        writing = false;
+        phase++;
+        //unless writers are preferred, the readers that waited for this write get in before the next one
+        released = policy == WRITER_PREFERRING ? 0 : readers_waiting;
+        can_read.notify_all();
+        if (released == 0) {
+            can_write.notify_one();
+        }
+    }
+    /**
+     * Constructor for the RWlock class
+     * */
+    RWlock() {
+        policy = READER_PREFERRING;
+        readers = 0;
+        readers_waiting = 0;
+        writers_waiting = 0;
+        released = 0;
+        writing = false;
+        phase = 0;
     }
 
+    private:
+    mutex m;
+    condition_variable can_read;
+    condition_variable can_write;
+    RWPolicy policy;
+    //readers holding the lock
+    int readers;
+    int readers_waiting;
+    int writers_waiting;
+    //readers woken by the last unlock that have not got in yet
+    int released;
+    bool writing;
+    //number of writes so far; a reader that has seen it change has waited for a whole write
+    unsigned long phase;
 };
 
 /**
- * reader is the function that the search threads run in. It takes the thread_id as input and runs the function at the beginning
- * of the search_queue once signaled that it can begin. Search threads have priority over modify threads.
+ * allocate returns a freshly constructed node, reusing a released node when there is one.
  * */
-static void * reader(void *arg);
+template <class N>
+N * NodePool<N>::allocate() {
+    void *mem;
+    if (free_list != NULL) {
+        mem = free_list;
+        free_list = free_list->parent;
+    } else {
+        //the last chunk is used up, carve the node out of a new one
+        if (used == CHUNK_NODES) {
+            chunks.push_back(static_cast<N *>(::operator new(CHUNK_NODES * sizeof(N))));
+            used = 0;
+        }
+        mem = chunks.back() + used;
+        used++;
+    }
+    return new (mem) N();
+}
 
 /**
- * writer is the function that the modify threads run in. It takes the thread_id as input and runs the function at the beginning
- * of the modify_queue once signaled that it can begin
+ * release returns a node that is no longer linked into the tree to the free list.
  * */
-static void * writer(void *arg);
+template <class N>
+void NodePool<N>::release(N *n) {
+    //drop whatever the mapped value owns
+    if (!is_trivially_destructible<N>::value) {
+        n->~N();
+        new (n) N();
+    }
+    n->parent = free_list;
+    free_list = n;
+}
 
 /**
- * read_file parses the input file for the tree nodes, thread information, and function calls.
- * Returns 1 if an error occurs while opening or reading the file.
+ * adopt takes over every chunk of other, with the nodes in them, and leaves other empty.
  * */
-int read_file(char *filename);
+template <class N>
+void NodePool<N>::adopt(NodePool &other) {
+    //carve out the rest of other's last chunk, so every chunk but our own last one stays full
+    if (!other.chunks.empty()) {
+        for (; other.used < CHUNK_NODES; other.used++) {
+            other.release(new (other.chunks.back() + other.used) N());
+        }
+    }
+    while (other.free_list != NULL) {
+        N *n = other.free_list;
+        other.free_list = n->parent;
+        n->parent = free_list;
+        free_list = n;
+    }
+    //our last chunk is still the one nodes are carved out of
+    chunks.insert(chunks.begin(), other.chunks.begin(), other.chunks.end());
+    other.chunks.clear();
+}
+
+/**
+ * Destructor for the NodePool class. Frees every chunk.
+ * */
+template <class N>
+NodePool<N>::~NodePool() {
+    for (size_t i=0; i<chunks.size(); i++) {
+        //every node carved out so far was constructed, whether it is in use or on the free list
+        if (!is_trivially_destructible<N>::value) {
+            size_t carved = i + 1 < chunks.size() ? CHUNK_NODES : used;
+            for (size_t j=0; j<carved; j++) {
+                chunks[i][j].~N();
+            }
+        }
+        ::operator delete(chunks[i]);
+    }
+}
+
+/**
+ * search returns true if the input key is present in the tree
+ * and false if it is not.
+ * */
+template <class Key, class Value, class Compare>
+bool RBtree<Key, Value, Compare>::search(const Key &num) {
+    return find(num) != nil;
+}
+
+/**
+ * search_batch sets results[i] to whether keys[i] is present in the tree, for the count keys. It walks SEARCH_GROUP
+ * searches down the tree in turns, one level each, prefetching the next node of each one, so the cache misses of
+ * the different searches overlap instead of following one another.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::search_batch(const Key *keys, size_t count, bool *results) {
+    //the node each search in flight is at and the index of its key
+    Node *at[SEARCH_GROUP];
+    size_t which[SEARCH_GROUP];
+    size_t next = 0;
+    size_t active = 0;
+    while (active < SEARCH_GROUP && next < count) {
+        at[active] = root;
+        which[active++] = next++;
+    }
+    while (active > 0) {
+        size_t i = 0;
+        while (i < active) {
+            Node *n = at[i];
+            const Key &num = keys[which[i]];
+            bool done = true;
+            if (n == nil) {
+                results[which[i]] = false;
+            } else if (comp(num, n->key)) {
+                n = n->left;
+                done = false;
+            } else if (comp(n->key, num)) {
+                n = n->right;
+                done = false;
+            } else {
+                results[which[i]] = true;
+            }
+            if (!done) {
+                __builtin_prefetch(n);
+                at[i++] = n;
+            } else if (next < count) {
+                //start the next key in the finished search's place
+                at[i] = root;
+                which[i++] = next++;
+            } else {
+                active--;
+                at[i] = at[active];
+                which[i] = which[active];
+            }
+        }
+    }
+}
+
+/**
+ * find returns the node holding the input key, or nil if the key is not in the tree.
+ * Integral keys ordered by less descend without branching on the comparisons: the walk always goes down to a leaf,
+ * remembering the last node whose key was not smaller, and checks that node for equality once at the end.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::find(const Key &num) {
+    Node *tmp = root;
+    if constexpr (is_integral<Key>::value && is_same<Compare, less<Key> >::value) {
+        Node *found = nil;
+        while (tmp != nil) {
+            bool right = tmp->key < num;
+            found = right ? found : tmp;
+            tmp = right ? tmp->right : tmp->left;
+        }
+        if (found != nil && found->key == num) {
+            return found;
+        }
+        return nil;
+    } else {
+        while (tmp != nil) {
+            //if node's key is greater, check it's left children
+            if (comp(num, tmp->key)) {
+                tmp = tmp->left;
+            //if node's key is less than, check it's right children
+            } else if (comp(tmp->key, num)) {
+                tmp = tmp->right;
+            } else {
+                return tmp;
+            }
+        }
+        return nil;
+    }
+}
+
+/**
+ * search_optimistic is a search that takes no lock. It walks the tree while writers may be modifying it and
+ * retries the walk whenever version shows that a modification overlapped it.
+ * */
+template <class Key, class Value, class Compare>
+bool RBtree<Key, Value, Compare>::search_optimistic(const Key &num) {
+    static_assert(is_integral<Key>::value, "lock-free searches need keys that can be loaded atomically");
+    while (true) {
+        unsigned long v = version.load(memory_order_acquire);
+        //a writer is in the middle of a modification
+        if (v & 1) {
+            continue;
+        }
+        bool found = false;
+        Node *tmp = __atomic_load_n(&root, __ATOMIC_RELAXED);
+        //a concurrent rotation can briefly leave a cycle or a half linked node, so never walk
+        //further than any red black tree can be tall
+        for (int depth = 0; tmp != nil && tmp != NULL && depth < MAX_DEPTH; depth++) {
+            Key key = __atomic_load_n(&tmp->key, __ATOMIC_RELAXED);
+            if (comp(num, key)) {
+                tmp = __atomic_load_n(&tmp->left, __ATOMIC_RELAXED);
+            } else if (comp(key, num)) {
+                tmp = __atomic_load_n(&tmp->right, __ATOMIC_RELAXED);
+            } else {
+                found = true;
+                break;
+            }
+        }
+        atomic_thread_fence(memory_order_acquire);
+        //only trust the walk if no writer touched the tree while it ran
+        if (version.load(memory_order_relaxed) == v) {
+            return found;
+        }
+    }
+}
+
+/**
+ * write_begin marks the start of a modification by making version odd.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::write_begin() {
+    version.store(version.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * write_end marks the end of a modification by making version even again.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::write_end() {
+    version.store(version.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+/**
+ * get_minimum is a helper search function that returns the node with the smallest key value that belongs
+ * to the subtree starting at node n.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::get_minimum(Node *n) {
+    Node *tmp = n;
+    while (tmp->left != nil) {
+        tmp = tmp->left;
+    }
+    return tmp;
+}
+
+/**
+ * delete_node removes the node with the inputted key value from the tree
+ * if it exists. It calls helper functions to maintain the red black characteristics.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::delete_node(const Key &num) {
+    Node *x = NULL;
+    //find the node with this key
+    Node *n = find(num);
+    //nothing to delete
+    if (n == nil) {
+        return;
+    }
+    //the neighbour of a smallest or largest key takes its place
+    bool extremes_known = extremes_version == version.load(memory_order_relaxed);
+    if (extremes_known && n == leftmost) {
+        leftmost = successor(n);
+    }
+    if (extremes_known && n == rightmost) {
+        rightmost = predecessor(n);
+    }
+    write_begin();
+    Node *tmp = n;
+    bool orig_color = tmp->color;
+    if (augmented) {
+        //the node that leaves its place is n itself or, with two children, its successor that takes n's place
+        Node *removed = n;
+        if (n->left != nil && n->right != nil) {
+            removed = get_minimum(n->right);
+        }
+        for (Node *a = removed->parent; a != nil; a = a->parent) {
+            a->size--;
+        }
+    }
+
+    if (n->left == nil) {
+        x = n->right;
+        transplant(n, n->right);
+    } else if (n->right == nil) {
+        x = n->left;
+        transplant(n, n->left);
+    } else {
+        tmp = get_minimum(n->right);
+        orig_color = tmp->color;
+        x = tmp->right;
+        if (tmp->parent == n) {
+            x->parent = tmp;
+        } else {
+            transplant(tmp, tmp->right);
+            tmp->right = n->right;
+            tmp->right->parent = tmp;
+        }
+        transplant(n, tmp);
+        tmp->left = n->left;
+        tmp->left->parent = tmp;
+        tmp->color = n->color;
+        tmp->size = n->size;
+    }
+    if (!orig_color) {
+        delete_node_fixup(x);
+    }
+    write_end();
+    if (extremes_known) {
+        extremes_version = version.load(memory_order_relaxed);
+    }
+    pool.release(n);
+}
 
-void write_file(RBtree *t);
+/**
+ * insert inserts a new node with the given key value into the tree. It calls helper
+ * functions to maintain the red black characteristics.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::insert(const Key &num, const Value &value) {
+    return insert_below(root, num, value);
+}
 
 /**
- * create_tree_helper is a recursive function that adds the nodes to the tree in preorder as they're listed.  It takes in a pointer to 
- * the tree, a vector containing the keys in preorder, a vector containing the colors in preorder, and a pointer to the index sharer
- * by the recursive calls of the function. It returns a pointer to the root of the tree.
+ * insert_hint inserts num like insert, but looks for its place starting from the node hint, typically the node
+ * inserted just before, instead of from the root. When hint holds the largest key and num is not smaller, or the
+ * smallest key and num is smaller, num goes right below hint. Otherwise it climbs from hint only until the first
+ * ancestor that bounds num on the far side and searches the subtree below it. The keys of an ascending or
+ * descending run are so placed in amortized constant time in a tree that is not augmented. A NULL or nil hint
+ * searches from the root. Returns the new node.
  * */
-Node * create_tree_helper(RBtree *t, vector<int> keys, vector<char> cols, int *index_ptr);
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::insert_hint(Node *hint, const Key &num, const Value &value) {
+    if (hint == NULL || hint == nil) {
+        return insert_below(root, num, value);
+    }
+    if (extremes_version != version.load(memory_order_relaxed)) {
+        find_extremes();
+    }
+    //num goes after hint exactly when insert would send it right of hint
+    bool after = !comp(num, hint->key);
+    //past the largest (or smallest) key, the free child of hint is the place of num
+    if ((after && hint == rightmost) || (!after && hint == leftmost)) {
+        return insert_below(hint, num, value);
+    }
+    //every key between hint and the first ancestor passed the other way is in the subtree just below that ancestor
+    Node *n = hint;
+    while (n->parent != nil) {
+        Node *p = n->parent;
+        if (after && n == p->left && comp(num, p->key)) {
+            return insert_below(n, num, value);
+        } else if (!after && n == p->right && !comp(num, p->key)) {
+            return insert_below(n, num, value);
+        }
+        n = p;
+    }
+    return insert_below(root, num, value);
+}
 
 /**
- * create_tree takes in a vector of strings that contains the nodes of the tree as inputted by the input file.
- * After separating the keys and the colors, it calls create_tree_helper to add the nodes to the tree.
- * Returns a pointer to the tree;
+ * insert_below inserts num, mapped to value, into the subtree of start, which must be where num belongs.
  * */
-RBtree * create_tree(vector<string> nodes);
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::insert_below(Node *start, const Key &num, const Value &value) {
+    Node *n = pool.allocate();
+    n->key = num;
+    n->set_value(value);
+    //assume color is red at start
+    n->color = true;
+    n->size = 1;
+    n->left = nil;
+    n->right = nil;
+    Node *x = start;
+    Node *y = nil;
+    bool left = false;
+    //figure out where n should be placed based on normal BST
+    while (x != nil) {
+        //y saves the what should be the parent node of n
+        y = x;
+        left = comp(num, x->key);
+        if (left) {
+            x = x->left;
+        } else {
+            x = x->right;
+        }
+    }
+    n->parent = y;
+    bool extremes_known = extremes_version == version.load(memory_order_relaxed);
+    write_begin();
+    //is n root, right child, or left child?
+    if (y == nil) {
+        root = n;
+    } else if (left) {
+        y->left = n;
+    } else {
+        y->right = n;
+    }
+    //a new smallest or largest key hangs off the outside of the old one
+    if (extremes_known && y == nil) {
+        leftmost = n;
+        rightmost = n;
+    } else if (extremes_known && left && y == leftmost) {
+        leftmost = n;
+    } else if (extremes_known && !left && y == rightmost) {
+        rightmost = n;
+    }
+    //n is one more node below each of its ancestors
+    if (augmented) {
+        for (Node *a = y; a != nil; a = a->parent) {
+            a->size++;
+        }
+    }
+    //fix any rb properties that were violated during insertion
+    insert_fixup(n);
+    write_end();
+    if (extremes_known) {
+        extremes_version = version.load(memory_order_relaxed);
+    }
+    return n;
+}
+
+/**
+ * transplant is a helper method for deletions that changes the relationships of the nodes during deletion.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::transplant(Node *n1, Node *n2) {
+    if (n1->parent == nil) {
+        root = n2;
+    } else if (n1 == n1->parent->left) {
+        n1->parent->left = n2;
+    } else {
+        n1->parent->right = n2;
+    }
+    n2->parent = n1->parent;
+}
+
+/**
+ * delete_node_fixup is a helper method that ensures the properties of the red black tree are maintained during deletion.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::delete_node_fixup(Node *n) {
+    Node *tmp = NULL;
+    while (n != root && n->color == false) {
+        RB_STAT(stats.delete_fixup_iterations++;)
+        if (n == n->parent->left) {
+            tmp = n->parent->right;
+            if (tmp->color) {
+                tmp->color = false;
+                n->parent->color = true;
+                left_rotate(n->parent);
+                tmp = n->parent->right;
+            }
+            if (tmp->left->color == false && tmp->right->color == false) {
+                tmp->color = true;
+                n = n->parent;
+            } else {
+                if (!tmp->right->color) {
+                    tmp->left->color = false;
+                    tmp->color = true;
+                    right_rotate(tmp);
+                    tmp = n->parent->right;
+                }
+                tmp->color = n->parent->color;
+                n->parent->color = false;
+                tmp->right->color = false;
+                left_rotate(n->parent);
+                n = root;
+            }
+        } else {
+            tmp = n->parent->left;
+            if (tmp->color) {
+                tmp->color = false;
+                n->parent->color = true;
+                right_rotate(n->parent);
+                tmp = n->parent->left;
+            }
+            if (tmp->right->color == false && tmp->left->color == false) {
+                tmp->color = true;
+                n = n->parent;
+            } else {
+                if (!tmp->left->color) {
+                    tmp->right->color = false;
+                    tmp->color = true;
+                    left_rotate(tmp);
+                    tmp = n->parent->left;
+                }
+                tmp->color = n->parent->color;
+                n->parent->color = false;
+                tmp->left->color = false;
+                right_rotate(n->parent);
+                n = root;
+            }
+        }
+    }
+    n->color = false;
+}
+
+/**
+ * insert_fixup is a helper method that ensures the properties of the red black tree are maintained during insertion.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::insert_fixup(Node *n) {
+    Node *tmp = NULL;
+    while (n->parent->color) {
+        RB_STAT(stats.insert_fixup_iterations++;)
+        //n's parent is a left child
+        if (n->parent == n->parent->parent->left) {
+            tmp = n->parent->parent->right;
+            //case 1: n's parent's parent's right child is red; n's parent is red, but does not have 2 black children
+            if (tmp->color) {
+                n->parent->color = false;
+                tmp->color = false;
+                n->parent->parent->color = true;
+                n = n->parent->parent;
+                //n's parent's parent's right child is black
+            } else {
+                //case 2: n is a right child
+                if (n == n->parent->right) {
+                    n = n->parent;
+                    left_rotate(n);
+                }
+                //case 3: red node with a red child
+                n->parent->color = false;
+                n->parent->parent->color = true;
+                right_rotate(n->parent->parent);
+            }
+            //n's parent is a right child
+        } else {
+            tmp = n->parent->parent->left;
+            //case 1: n's parent's parent's left child is red; n's parent is red, but does not have 2 black children
+            if (tmp->color) {
+                n->parent->color = false;
+                tmp->color = false;
+                n->parent->parent->color = true;
+                n = n->parent->parent;
+                ////n's parent's parent's left child is black
+            } else {
+                //case 2: n is a left child
+                if (n == n->parent->left) {
+                    n = n->parent;
+                    right_rotate(n);
+                }
+                //case 3: red node with a red child
+                n->parent->color = false;
+                n->parent->parent->color = true;
+                left_rotate(n->parent->parent);
+            }
+        }
+    }
+    //make the root black
+    root->color = false;
+}
+
+/**
+ * left_rotate performs a left rotation on the node n and its children
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::left_rotate(Node *n) {
+    RB_STAT(stats.rotations++;)
+    Node *tmp = n->right;
+    n->right = tmp->left;
+    if (tmp->left != nil) {
+        tmp->left->parent = n;
+    }
+    tmp->parent = n->parent;
+    if (n->parent == nil) {
+        root = tmp;
+    } else if (n == n->parent->left) {
+        n->parent->left = tmp;
+    } else {
+        n->parent->right = tmp;
+    }
+    tmp->left = n;
+    n->parent = tmp;
+    if (augmented) {
+        tmp->size = n->size;
+        n->size = n->left->size + n->right->size + 1;
+    }
+}
+
+/**
+ * right_rotate performs a right rotation on the node n and its children
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::right_rotate(Node *n) {
+    RB_STAT(stats.rotations++;)
+    Node *tmp = n->left;
+    n->left = tmp->right;
+    if (tmp->right != nil) {
+        tmp->right->parent = n;
+    }
+    tmp->parent = n->parent;
+    if (n->parent == nil) {
+        root = tmp;
+    } else if (n == n->parent->right) {
+        n->parent->right = tmp;
+    } else {
+        n->parent->left = tmp;
+    }
+    tmp->right = n;
+    n->parent = tmp;
+    if (augmented) {
+        tmp->size = n->size;
+        n->size = n->left->size + n->right->size + 1;
+    }
+}
+
+/**
+ * rank returns the number of keys in the tree that are smaller than num.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::rank(const Key &num) {
+    return count_below(num, false);
+}
+
+/**
+ * select returns the node with the k-th smallest key, counting from 1, or nil if the tree has fewer than k keys.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::select(int k) {
+    Node *tmp = root;
+    while (tmp != nil) {
+        int left = tmp->left->size;
+        if (k == left + 1) {
+            return tmp;
+        //the k-th key is in the left subtree
+        } else if (k <= left) {
+            tmp = tmp->left;
+        //skip the left subtree and this node
+        } else {
+            k -= left + 1;
+            tmp = tmp->right;
+        }
+    }
+    return nil;
+}
+
+/**
+ * range_count returns the number of keys in the tree between lo and hi, both included.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::range_count(const Key &lo, const Key &hi) {
+    if (comp(hi, lo)) {
+        return 0;
+    }
+    return count_below(hi, true) - count_below(lo, false);
+}
+
+/**
+ * count_below returns the number of keys in the tree smaller than num, or smaller than or equal to num if inclusive is true.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::count_below(const Key &num, bool inclusive) {
+    int count = 0;
+    Node *tmp = root;
+    while (tmp != nil) {
+        //this node and its left subtree are all below num
+        if (comp(tmp->key, num) || (inclusive && !comp(num, tmp->key))) {
+            count += tmp->left->size + 1;
+            tmp = tmp->right;
+        } else {
+            tmp = tmp->left;
+        }
+    }
+    return count;
+}
+
+/**
+ * size returns the number of keys in the tree: the size of the root in an augmented tree, and otherwise the number
+ * counted by walking the whole tree.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::size() {
+    if (augmented || root == nil) {
+        return root->size;
+    }
+    int count = 0;
+    for (Node *n = get_minimum(root); n != nil; n = successor(n)) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * find_extremes looks up the nodes with the smallest and largest keys, which insert and delete_node then keep up to
+ * date until an operation on the whole tree changes it.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::find_extremes() {
+    leftmost = root;
+    rightmost = root;
+    if (root != nil) {
+        leftmost = get_minimum(root);
+        while (rightmost->right != nil) {
+            rightmost = rightmost->right;
+        }
+    }
+    extremes_version = version.load(memory_order_relaxed);
+}
+
+/**
+ * successor returns the node that follows n in key order, or nil if n has the largest key.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::successor(Node *n) {
+    if (n->right != nil) {
+        return get_minimum(n->right);
+    }
+    //climb until we come up from a left child
+    Node *p = n->parent;
+    while (p != nil && n == p->right) {
+        n = p;
+        p = p->parent;
+    }
+    return p;
+}
+
+/**
+ * predecessor returns the node that comes before n in key order, or nil if n has the smallest key.
+ * The predecessor of nil is the node with the largest key.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::predecessor(Node *n) {
+    if (n == nil) {
+        n = root;
+        if (n == nil) {
+            return nil;
+        }
+        while (n->right != nil) {
+            n = n->right;
+        }
+        return n;
+    }
+    if (n->left != nil) {
+        n = n->left;
+        while (n->right != nil) {
+            n = n->right;
+        }
+        return n;
+    }
+    //climb until we come up from a right child
+    Node *p = n->parent;
+    while (p != nil && n == p->left) {
+        n = p;
+        p = p->parent;
+    }
+    return p;
+}
+
+/**
+ * begin returns an iterator at the smallest key.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::iterator RBtree<Key, Value, Compare>::begin() {
+    if (root == nil) {
+        return end();
+    }
+    return iterator(this, get_minimum(root));
+}
+
+/**
+ * end returns the iterator past the largest key.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::iterator RBtree<Key, Value, Compare>::end() {
+    return iterator(this, nil);
+}
+
+/**
+ * lower_bound returns an iterator at the first key that is not smaller than num.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::iterator RBtree<Key, Value, Compare>::lower_bound(const Key &num) {
+    Node *tmp = root;
+    Node *found = nil;
+    while (tmp != nil) {
+        if (!comp(tmp->key, num)) {
+            found = tmp;
+            tmp = tmp->left;
+        } else {
+            tmp = tmp->right;
+        }
+    }
+    return iterator(this, found);
+}
+
+/**
+ * upper_bound returns an iterator at the first key that is larger than num.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::iterator RBtree<Key, Value, Compare>::upper_bound(const Key &num) {
+    Node *tmp = root;
+    Node *found = nil;
+    while (tmp != nil) {
+        if (comp(num, tmp->key)) {
+            found = tmp;
+            tmp = tmp->left;
+        } else {
+            tmp = tmp->right;
+        }
+    }
+    return iterator(this, found);
+}
+
+/**
+ * compute_sizes sets the size of every node of a tree that was linked together without maintaining them.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::compute_sizes() {
+    //visit the nodes in reverse preorder, so both children of a node are done before the node itself
+    vector<Node *> order;
+    vector<Node *> stack;
+    if (root != nil) {
+        stack.push_back(root);
+    }
+    while (!stack.empty()) {
+        Node *n = stack.back();
+        stack.pop_back();
+        order.push_back(n);
+        if (n->left != nil) {
+            stack.push_back(n->left);
+        }
+        if (n->right != nil) {
+            stack.push_back(n->right);
+        }
+    }
+    for (size_t i=order.size(); i>0; i--) {
+        Node *n = order[i-1];
+        n->size = n->left->size + n->right->size + 1;
+    }
+}
+
+/**
+ * preorder_print prints the subtree of node n in preorder, with "f" for every nil leaf, the format of the first line of
+ * the input file. It walks the tree with an explicit stack and formats the keys into a large buffer that is written
+ * out in blocks.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::preorder_print(Node *n, ofstream& out) {
+    vector<char> buffer(PRINT_BUFFER);
+    char *buf = buffer.data();
+    char *limit = buf + PRINT_BUFFER - 32;
+    char *p = buf;
+    vector<Node *> stack;
+    stack.push_back(n);
+    bool first = true;
+    while (!stack.empty()) {
+        Node *tmp = stack.back();
+        stack.pop_back();
+        //flush when a comma, a key and its color might not fit anymore
+        if (p > limit) {
+            out.write(buf, p - buf);
+            p = buf;
+        }
+        if (!first) {
+            *p++ = ',';
+        }
+        first = false;
+        if (tmp == nil) {
+            *p++ = 'f';
+            continue;
+        }
+        if constexpr (is_integral<Key>::value) {
+            //format the key backwards into a small scratch space, then copy it over
+            char digits[24];
+            char *d = digits;
+            bool neg = tmp->key < 0;
+            unsigned long long v = neg ? 0ULL - (unsigned long long) tmp->key : (unsigned long long) tmp->key;
+            do {
+                *d++ = '0' + v % 10;
+                v /= 10;
+            } while (v != 0);
+            if (neg) {
+                *p++ = '-';
+            }
+            while (d > digits) {
+                *p++ = *--d;
+            }
+        } else {
+            //other keys print themselves, which can take any length
+            ostringstream text;
+            text << tmp->key;
+            string key = text.str();
+            if (p + key.size() > limit) {
+                out.write(buf, p - buf);
+                p = buf;
+            }
+            if (key.size() > (size_t) (limit - buf)) {
+                out.write(key.data(), key.size());
+            } else {
+                memcpy(p, key.data(), key.size());
+                p += key.size();
+            }
+        }
+        *p++ = tmp->color ? 'r' : 'b';
+        stack.push_back(tmp->right);
+        stack.push_back(tmp->left);
+    }
+    out.write(buf, p - buf);
+}
+
+/**
+ * save writes the tree to the binary snapshot file filename: a SnapshotHeader followed by the keys of the nodes
+ * in preorder, their mapped values unless the tree is a set, and then one byte per node with its color and which
+ * children it has. Returns 1 if an error occurs while writing the file.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::save(const char *filename) {
+    static_assert(is_trivially_copyable<Key>::value, "snapshots store the raw bytes of the keys");
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        return 1;
+    }
+    SnapshotHeader header = {{'R', 'B', 'T', 0}, SNAPSHOT_VERSION, sizeof(Key), snapshot_value_size(), 0};
+    fwrite(&header, sizeof(header), 1, f);
+    vector<uint8_t> flags;
+    vector<Value> values;
+    vector<Key> keys;
+    keys.reserve(SNAPSHOT_BUFFER);
+    //walk the tree in preorder with an explicit stack, writing the keys out in blocks
+    vector<Node *> stack;
+    if (root != nil) {
+        stack.push_back(root);
+    }
+    while (!stack.empty()) {
+        Node *n = stack.back();
+        stack.pop_back();
+        keys.push_back(n->key);
+        if (snapshot_value_size() != 0) {
+            values.push_back(n->get_value());
+        }
+        flags.push_back((n->color ? SNAPSHOT_RED : 0) | (n->left != nil ? SNAPSHOT_LEFT : 0) | (n->right != nil ? SNAPSHOT_RIGHT : 0));
+        if (keys.size() == SNAPSHOT_BUFFER) {
+            fwrite(keys.data(), sizeof(Key), keys.size(), f);
+            keys.clear();
+        }
+        if (n->right != nil) {
+            stack.push_back(n->right);
+        }
+        if (n->left != nil) {
+            stack.push_back(n->left);
+        }
+    }
+    fwrite(keys.data(), sizeof(Key), keys.size(), f);
+    //a set has no values, and an empty vector may have no buffer at all
+    if (!values.empty()) {
+        fwrite(values.data(), snapshot_value_size(), values.size(), f);
+    }
+    fwrite(flags.data(), 1, flags.size(), f);
+    //now that the nodes are counted, fill in the header
+    header.count = flags.size();
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+    if (ferror(f)) {
+        fclose(f);
+        return 1;
+    }
+    return fclose(f) != 0;
+}
+
+/**
+ * load rebuilds the tree, which must be empty, from the binary snapshot file filename written by save.
+ * The file is memory mapped and read in a single pass.
+ * Returns 1 if an error occurs while opening or reading the file.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::load(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return 1;
+    }
+    size_t len = st.st_size;
+    void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 1;
+    }
+    madvise(data, len, MADV_SEQUENTIAL);
+    const SnapshotHeader *header = (const SnapshotHeader *) data;
+    uint64_t count = header->count;
+    size_t value_size = snapshot_value_size();
+    if (memcmp(header->magic, "RBT", 4) != 0 || header->version != SNAPSHOT_VERSION
+        || header->key_size != sizeof(Key) || header->value_size != value_size
+        || count > (len - sizeof(SnapshotHeader)) / (sizeof(Key) + value_size + 1)) {
+        munmap(data, len);
+        return 1;
+    }
+    const char *keys = (const char *) (header + 1);
+    const char *values = keys + count * sizeof(Key);
+    const uint8_t *flags = (const uint8_t *) (values + count * value_size);
+    //nodes whose children have not all been read yet; a missing child that is still to come is NULL
+    vector<Node *> stack;
+    for (uint64_t i=0; i<count; i++) {
+        Node *n = pool.allocate();
+        //the sections are packed, so copy the bytes out rather than trusting their alignment
+        memcpy(&n->key, keys + i * sizeof(Key), sizeof(Key));
+        if (value_size != 0) {
+            Value value;
+            memcpy(&value, values + i * value_size, value_size);
+            n->set_value(value);
+        }
+        n->color = flags[i] & SNAPSHOT_RED;
+        n->left = (flags[i] & SNAPSHOT_LEFT) ? NULL : nil;
+        n->right = (flags[i] & SNAPSHOT_RIGHT) ? NULL : nil;
+        if (i == 0) {
+            root = n;
+            n->parent = nil;
+        } else {
+            Node *top = stack.back();
+            if (top->left == NULL) {
+                top->left = n;
+                if (top->right != NULL) {
+                    stack.pop_back();
+                }
+            } else {
+                top->right = n;
+                stack.pop_back();
+            }
+            n->parent = top;
+        }
+        if (n->left == NULL || n->right == NULL) {
+            stack.push_back(n);
+        }
+    }
+    munmap(data, len);
+    //a truncated snapshot leaves children that never came
+    if (!stack.empty()) {
+        return 1;
+    }
+    if (augmented) {
+        compute_sizes();
+    }
+    return 0;
+}
+
+/**
+ * height returns the number of nodes on the longest path from the root down to a leaf; 0 for an empty tree.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::height() {
+    int h = 0;
+    vector<pair<Node *, int> > stack;
+    if (root != nil) {
+        stack.push_back(make_pair(root, 1));
+    }
+    while (!stack.empty()) {
+        Node *n = stack.back().first;
+        int d = stack.back().second;
+        stack.pop_back();
+        if (d > h) {
+            h = d;
+        }
+        if (n->left != nil) {
+            stack.push_back(make_pair(n->left, d + 1));
+        }
+        if (n->right != nil) {
+            stack.push_back(make_pair(n->right, d + 1));
+        }
+    }
+    return h;
+}
+
+/**
+ * adopt moves the nodes of other into this tree's pool, makes them use this tree's nil and leaves other empty.
+ * Returns the root of other's nodes.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::adopt(RBtree *other) {
+    if (augmented && !other->augmented) {
+        other->compute_sizes();
+    }
+    Node *t = other->root;
+    Node *old_nil = other->nil;
+    pool.adopt(other->pool);
+    vector<Node *> stack;
+    if (t != old_nil) {
+        stack.push_back(t);
+    }
+    while (!stack.empty()) {
+        Node *n = stack.back();
+        stack.pop_back();
+        if (n->left == old_nil) {
+            n->left = nil;
+        } else {
+            stack.push_back(n->left);
+        }
+        if (n->right == old_nil) {
+            n->right = nil;
+        } else {
+            stack.push_back(n->right);
+        }
+    }
+    t = t == old_nil ? nil : t;
+    pool.release(old_nil);
+    other->nil = other->pool.allocate();
+    other->root = other->nil;
+    other->root->parent = other->nil;
+    return t;
+}
+
+/**
+ * black_height returns the number of black nodes on any path from t down to a leaf, counting t and not nil.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::black_height(Node *t) {
+    int h = 0;
+    for (; t != nil; t = t->left) {
+        h += !t->color;
+    }
+    return h;
+}
+
+/**
+ * weight returns the number of keys below t in an augmented tree, and otherwise the fewest keys a subtree of its black
+ * height holds, which is enough for the set operations to decide whether to fork.
+ * */
+template <class Key, class Value, class Compare>
+long RBtree<Key, Value, Compare>::weight(Node *t) {
+    if (augmented) {
+        return t->size;
+    }
+    return (1L << black_height(t)) - 1;
+}
+
+/**
+ * link makes l and r the children of k, colors k and returns it.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::link(Node *l, Node *k, Node *r, bool red) {
+    k->left = l;
+    k->right = r;
+    k->color = red;
+    if (augmented) {
+        k->size = l->size + r->size + 1;
+    }
+    //nil is shared by every subtree the parallel set operations work on, so it is never written
+    if (l != nil) {
+        l->parent = k;
+    }
+    if (r != nil) {
+        r->parent = k;
+    }
+    return k;
+}
+
+/**
+ * join_right joins l, k and r where l, of black height hl, is at least as high as r, of black height hr, by hanging
+ * k and r on the right spine of l. The root of the result may be red with a red right child.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::join_right(Node *l, int hl, Node *k, Node *r, int hr) {
+    if (!l->color && hl == hr) {
+        return link(l, k, r, true);
+    }
+    Node *t = link(l->left, l, join_right(l->right, hl - !l->color, k, r, hr), l->color);
+    //two reds in a row below a black node: rotate left
+    if (!t->color && t->right->color && t->right->right->color) {
+        t->right->right->color = false;
+        Node *x = t->right;
+        return link(link(t->left, t, x->left, false), x, x->right, true);
+    }
+    return t;
+}
+
+/**
+ * join_left is join_right with the sides swapped: r is higher and k and l are hung on its left spine.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::join_left(Node *l, int hl, Node *k, Node *r, int hr) {
+    if (!r->color && hl == hr) {
+        return link(l, k, r, true);
+    }
+    Node *t = link(join_left(l, hl, k, r->left, hr - !r->color), r, r->right, r->color);
+    if (!t->color && t->left->color && t->left->left->color) {
+        t->left->left->color = false;
+        Node *x = t->left;
+        return link(x->left, x, link(x->right, t, t->right, false), true);
+    }
+    return t;
+}
+
+/**
+ * join_nodes returns a red black tree of the keys of l, then k, then the keys of r, in time proportional to the
+ * difference of their heights. Every key of l must not be larger than k and every key of r not smaller.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::join_nodes(Node *l, Node *k, Node *r) {
+    //a subtree cut out of a tree may have a red root; making it black keeps it a red black tree
+    if (l != nil && l->color) {
+        l->color = false;
+    }
+    if (r != nil && r->color) {
+        r->color = false;
+    }
+    int hl = black_height(l);
+    int hr = black_height(r);
+    Node *t;
+    if (hl > hr) {
+        t = join_right(l, hl, k, r, hr);
+        if (t->color && t->right->color) {
+            t->color = false;
+        }
+    } else if (hl < hr) {
+        t = join_left(l, hl, k, r, hr);
+        if (t->color && t->left->color) {
+            t->color = false;
+        }
+    } else {
+        t = link(l, k, r, false);
+    }
+    return t;
+}
+
+/**
+ * split_last removes the node with the largest key from t, sets rest to the remaining tree and returns the node.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::split_last(Node *t, Node *&rest) {
+    if (t->right == nil) {
+        rest = t->left;
+        return t;
+    }
+    Node *r;
+    Node *last = split_last(t->right, r);
+    rest = join_nodes(t->left, t, r);
+    return last;
+}
+
+/**
+ * join2_nodes returns a red black tree of the keys of l followed by the keys of r.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::join2_nodes(Node *l, Node *r) {
+    if (l == nil) {
+        return r;
+    }
+    Node *rest;
+    Node *k = split_last(l, rest);
+    return join_nodes(rest, k, r);
+}
+
+/**
+ * split_nodes splits t into l, the keys smaller than num, and r, the larger ones. When found is NULL the keys equal to
+ * num go to r; otherwise one node with the key num, if there is one, is taken out and stored in *found.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::split_nodes(Node *t, const Key &num, Node *&l, Node *&r, Node **found) {
+    if (t == nil) {
+        l = nil;
+        r = nil;
+        return;
+    }
+    if (comp(num, t->key) || (found == NULL && !comp(t->key, num))) {
+        Node *rl;
+        split_nodes(t->left, num, l, rl, found);
+        r = join_nodes(rl, t, t->right);
+    } else if (comp(t->key, num)) {
+        Node *lr;
+        split_nodes(t->right, num, lr, r, found);
+        l = join_nodes(t->left, t, lr);
+    } else {
+        l = t->left;
+        r = t->right;
+        *found = t;
+    }
+}
+
+/**
+ * discard hands t, with its whole subtree when whole is true, to the garbage to be freed after the operation.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::discard(Node *t, bool whole) {
+    if (t == nil) {
+        return;
+    }
+    if (!whole) {
+        t->left = nil;
+        t->right = nil;
+    }
+    garbage_lock.lock();
+    garbage.push_back(t);
+    garbage_lock.unlock();
+}
+
+/**
+ * free_garbage returns every node handed to discard to the pool.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::free_garbage() {
+    while (!garbage.empty()) {
+        Node *n = garbage.back();
+        garbage.pop_back();
+        if (n->left != nil) {
+            garbage.push_back(n->left);
+        }
+        if (n->right != nil) {
+            garbage.push_back(n->right);
+        }
+        pool.release(n);
+    }
+}
+
+/**
+ * forks returns how many times the set operations may split their work in two, enough to give every core a share.
+ * */
+template <class Key, class Value, class Compare>
+int RBtree<Key, Value, Compare>::forks() {
+    int f = 0;
+    for (unsigned cores = thread::hardware_concurrency(); (1u << f) < cores; f++) {
+    }
+    return f;
+}
+
+/**
+ * union_nodes returns the union of the trees a and b. The two halves are done at the same time by two threads while
+ * forks allows it. Where both trees hold a key, the node of b is discarded unless keep_both is true.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::union_nodes(Node *a, Node *b, bool keep_both, int forks) {
+    if (a == nil) {
+        return b;
+    }
+    if (b == nil) {
+        return a;
+    }
+    Node *bl, *br;
+    Node *dup = NULL;
+    split_nodes(b, a->key, bl, br, keep_both ? NULL : &dup);
+    if (dup != NULL) {
+        discard(dup, false);
+    }
+    Node *al = a->left;
+    Node *ar = a->right;
+    Node *l, *r;
+    if (forks > 0 && weight(a) + weight(b) >= 2 * PARALLEL_CUTOFF) {
+        thread left([&]() {
+            l = union_nodes(al, bl, keep_both, forks - 1);
+        });
+        r = union_nodes(ar, br, keep_both, forks - 1);
+        left.join();
+    } else {
+        l = union_nodes(al, bl, keep_both, 0);
+        r = union_nodes(ar, br, keep_both, 0);
+    }
+    return join_nodes(l, a, r);
+}
+
+/**
+ * intersect_nodes returns the keys of a that are also in b, with the nodes of a; the other nodes are discarded.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::intersect_nodes(Node *a, Node *b, int forks) {
+    if (a == nil || b == nil) {
+        discard(a, true);
+        discard(b, true);
+        return nil;
+    }
+    Node *bl, *br;
+    Node *dup = NULL;
+    split_nodes(b, a->key, bl, br, &dup);
+    Node *al = a->left;
+    Node *ar = a->right;
+    Node *l, *r;
+    if (forks > 0 && weight(a) + weight(b) >= 2 * PARALLEL_CUTOFF) {
+        thread left([&]() {
+            l = intersect_nodes(al, bl, forks - 1);
+        });
+        r = intersect_nodes(ar, br, forks - 1);
+        left.join();
+    } else {
+        l = intersect_nodes(al, bl, 0);
+        r = intersect_nodes(ar, br, 0);
+    }
+    if (dup != NULL) {
+        discard(dup, false);
+        return join_nodes(l, a, r);
+    }
+    discard(a, false);
+    return join2_nodes(l, r);
+}
+
+/**
+ * subtract_nodes returns the keys of a that are not in b; the nodes of b and the removed nodes of a are discarded.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::subtract_nodes(Node *a, Node *b, int forks) {
+    if (a == nil || b == nil) {
+        discard(b, true);
+        return a;
+    }
+    Node *al, *ar;
+    Node *dup = NULL;
+    split_nodes(a, b->key, al, ar, &dup);
+    Node *bl = b->left;
+    Node *br = b->right;
+    Node *l, *r;
+    if (forks > 0 && weight(a) + weight(b) >= 2 * PARALLEL_CUTOFF) {
+        thread left([&]() {
+            l = subtract_nodes(al, bl, forks - 1);
+        });
+        r = subtract_nodes(ar, br, forks - 1);
+        left.join();
+    } else {
+        l = subtract_nodes(al, bl, 0);
+        r = subtract_nodes(ar, br, 0);
+    }
+    discard(b, false);
+    if (dup != NULL) {
+        discard(dup, false);
+    }
+    return join2_nodes(l, r);
+}
+
+/**
+ * set_root makes t the root of the tree, which must be black, and frees the discarded nodes.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::set_root(Node *t) {
+    root = t;
+    if (root != nil) {
+        root->parent = nil;
+        root->color = false;
+    }
+    free_garbage();
+}
+
+/**
+ * join appends every node of other, whose keys must not be smaller than any key of this tree, and leaves other empty.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::join(RBtree *other) {
+    write_begin();
+    Node *t = adopt(other);
+    set_root(join2_nodes(root, t));
+    write_end();
+}
+
+/**
+ * split moves every key that is not smaller than num into a new tree and returns it. The nodes of the new tree come
+ * from its own pool, so the moved keys are copied, in time proportional to their number.
+ * */
+template <class Key, class Value, class Compare>
+RBtree<Key, Value, Compare> * RBtree<Key, Value, Compare>::split(const Key &num) {
+    Node *l, *r;
+    write_begin();
+    split_nodes(root, num, l, r, NULL);
+    RBtree *rest = new RBtree(augmented);
+    rest->root = rest->clone(r, nil);
+    rest->root->parent = rest->nil;
+    rest->root->color = false;
+    discard(r, true);
+    set_root(l);
+    write_end();
+    return rest;
+}
+
+/**
+ * clone copies the subtree t, whose leaves are other_nil, into nodes of this tree's pool and returns its root.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * RBtree<Key, Value, Compare>::clone(Node *t, Node *other_nil) {
+    if (t == other_nil) {
+        return nil;
+    }
+    Node *n = pool.allocate();
+    n->key = t->key;
+    n->set_value(t->get_value());
+    return link(clone(t->left, other_nil), n, clone(t->right, other_nil), t->color);
+}
+
+/**
+ * set_union adds the keys of other that are not in this tree and leaves other empty. Where both trees hold a key,
+ * this tree's node and value are kept.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::set_union(RBtree *other) {
+    write_begin();
+    Node *b = adopt(other);
+    set_root(union_nodes(root, b, false, forks()));
+    write_end();
+}
+
+/**
+ * set_intersection removes the keys that are not in other and leaves other empty.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::set_intersection(RBtree *other) {
+    write_begin();
+    Node *b = adopt(other);
+    set_root(intersect_nodes(root, b, forks()));
+    write_end();
+}
+
+/**
+ * set_difference removes the keys that are in other and leaves other empty.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::set_difference(RBtree *other) {
+    write_begin();
+    Node *b = adopt(other);
+    set_root(subtract_nodes(root, b, forks()));
+    write_end();
+}
+
+/**
+ * merge adds every node of other, including keys that are already in this tree, and leaves other empty.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::merge(RBtree *other) {
+    write_begin();
+    Node *b = adopt(other);
+    set_root(union_nodes(root, b, true, forks()));
+    write_end();
+}
+
+/**
+ * bulk_insert inserts the keys, which must be in ascending order, by building a balanced tree of them in linear time
+ * and merging it in, which touches O(k log(n / k + 1)) nodes of the tree for k keys instead of running k inserts.
+ * */
+template <class Key, class Value, class Compare>
+void RBtree<Key, Value, Compare>::bulk_insert(const vector<Key> &keys) {
+    if (keys.empty()) {
+        return;
+    }
+    //the same coloring as create_tree_sorted: only the deepest level is red
+    int red_depth = 0;
+    while ((2UL << red_depth) <= keys.size()) {
+        red_depth++;
+    }
+    if (red_depth == 0) {
+        red_depth = -1;
+    }
+    write_begin();
+    Node *b = create_sorted_helper(this, keys, 0, (long) keys.size() - 1, 0, red_depth);
+    set_root(union_nodes(root, b, true, forks()));
+    write_end();
+}
+
+#ifdef RB_STATS
+/**
+ * The ThreadStats struct is what one worker thread measured about itself in an RB_STATS build. Times are in nanoseconds.
+ * */
+struct ThreadStats {
+    //commands run, by CommandType
+    unsigned long ops[NUM_COMMANDS];
+    //time spent waiting on work_ready for the parser to queue a command
+    unsigned long queue_wait_ns;
+    //time a modify thread spent waiting for the pending searches to finish
+    unsigned long search_wait_ns;
+    //number of times the tree lock was taken, shared or exclusive
+    unsigned long lock_acquisitions;
+    //time spent waiting for the tree lock
+    unsigned long lock_wait_ns;
+    //time the tree lock was held
+    unsigned long lock_hold_ns;
+};
+
+/**
+ * write_stats prints the counters of every thread and of the tree t as a summary section of out and as JSON to the
+ * file "stats.json".
+ * */
+void write_stats(ofstream &out, RBtree<int> *t);
+#endif
+
+/**
+ * RESULT_LOG_RESERVE is the number of results the log of every worker thread has room for from the start.
+ * */
+#define RESULT_LOG_RESERVE 65536
+
+/**
+ * The Result struct is one command run by a worker thread and its outcome, kept in binary until write_file prints it.
+ * */
+struct Result {
+    //when the command took effect, from now_ns
+    unsigned long time;
+    Command c;
+    //search: 1 if the key was found; rank and range_count: the count; select: the key; range: the index in the keys of
+    //the log of the first key found
+    long outcome;
+    //select: 1 if there was a key to select; range: the number of keys found
+    int length;
+    //the thread that ran the command
+    int thread;
+};
+
+/**
+ * The ResultLog struct holds the results of one worker thread in the order it produced them. Only that thread writes
+ * to it, and it starts on a cache line of its own so the logs of two threads never share one.
+ * */
+struct alignas(64) ResultLog {
+    int thread;
+    vector<Result> results;
+    //the keys found by the range commands, one after the other
+    vector<int> keys;
+};
+
+struct Connection;
+
+/**
+ * The Request struct is one line of commands sent to the server. The threads fill in the result of each command as
+ * they finish it, and the last one to finish wakes up the connection to send them back.
+ * */
+struct Request {
+    //the result of each command of the line, in the order they were sent
+    vector<string> lines;
+    //commands that have not finished yet
+    atomic<int> remaining;
+    //the request inserts or deletes
+    bool modifies = false;
+    Connection *conn;
+};
+
+/**
+ * The Connection struct is one client of the server: where its requests come from and go back to, and the requests
+ * that have not been answered yet, in the order they came in.
+ * */
+struct Connection {
+    int in_fd;
+    int out_fd;
+    mutex lock;
+    //signalled when a request finishes or the client is gone
+    condition_variable ready;
+    queue<Request *> pending;
+    //requests whose commands are running, and those of them that modify the tree
+    int running = 0;
+    int modifying = 0;
+    //no more requests will come in
+    bool closed;
+};
+
+/**
+ * now_ns returns a monotonic timestamp in nanoseconds for the result logs and the instrumentation.
+ * */
+unsigned long now_ns();
+
+/**
+ * add_result appends the result of the command c to the log of the calling thread, stamped with the current time.
+ * */
+void add_result(const Command &c, long outcome, int length);
+
+/**
+ * run_query runs a command that only reads the tree and adds its result to the log of the calling thread.
+ * Searches take no lock when optimistic searches are on; every other query holds the tree lock shared. With the frozen
+ * index turned on, searches are answered from it instead, whether or not optimistic searches are on.
+ * */
+void run_query(const Command &c);
+
+/**
+ * run_query_batch runs a batch of commands that only read the tree and adds their results to the log of the calling
+ * thread, in order. The searches of the batch are answered together by search_batch, or by the frozen index, under a
+ * single shared hold of the tree lock; the other commands, and every command of a sharded tree or of one in path
+ * copying mode, go through run_query one at a time.
+ * */
+void run_query_batch(const vector<Command> &batch);
+
+/**
+ * run_sharded_query is run_query for a sharded tree. Each query locks the shards it reads itself.
+ * */
+void run_sharded_query(const Command &c);
+
+/**
+ * run_persistent_query is run_query for a tree in path copying mode. Each query reads one version of the tree without
+ * taking a lock.
+ * */
+void run_persistent_query(const Command &c);
+
+/**
+ * reader is the function that the search threads run in. It takes the thread_id as input and keeps running the search
+ * at the front of the search_queue until the queue is drained and the whole input has been parsed. Search threads have
+ * priority over modify threads. In batched mode it takes up to batch_size queries at once and runs them together.
+ * */
+void * reader(void *arg);
+
+/**
+ * writer is the function that the modify threads run in. It takes the thread_id as input and keeps running the modification
+ * at the front of the modify_queue until the queue is drained and the whole input has been parsed. A modification only
+ * starts once every search queued so far has finished. A run of inserts with ascending or descending keys at the front
+ * of the queue is taken and applied together, each insert starting from the node of the one before. In combining mode
+ * the thread instead takes every modification waiting in the queue and applies them sorted by key under a single hold
+ * of the tree lock, merging the inserts of the keys the batch does not delete in with RBtree::bulk_insert.
+ * */
+void * writer(void *arg);
+
+/**
+ * shard_sample returns keys to pick the shard bounds with besides the keys of the tree: the keys inserted by the first
+ * SHARD_SAMPLE commands starting at p, and if the tree and those keys together still have fewer than num_shards
+ * distinct keys, keys spread evenly over the whole int range.
+ * */
+vector<int> shard_sample(const char *p, const char *end, RBtree<int> *t);
+
+/**
+ * log_commands appends the n inserts and deletes at c to the write-ahead log. Modifications of one key must be logged
+ * in the order they are applied, so it is called under the lock that orders them.
+ * */
+void log_commands(const Command *c, size_t n);
+
+/**
+ * compact_log compacts the write-ahead log into a snapshot of the tree if it has grown enough. Searches go on while
+ * the snapshot is written, but modifications wait for it. With shards the log is only compacted at the end.
+ * */
+void compact_log();
+
+/**
+ * extends_run returns true if the insert c continues the run of inserts in run, whose keys all go up or all go down.
+ * */
+bool extends_run(const vector<Command> &run, const Command &c);
+
+/**
+ * create_threads creates the pool of search and modify threads specified by the input integers search_threads and
+ * modify_threads. The threads start working on the queues right away while the commands are still being parsed.
+ * */
+void create_threads(int search_threads, int modify_threads);
+
+/**
+ * join_threads tells the pool that no more commands are coming and waits for it to drain the queues and exit.
+ * */
+void join_threads();
+
+/**
+ * enqueue_commands adds a batch of parsed commands to their queues, waiting while the queues are full, and wakes up
+ * the threads that are waiting for work.
+ * */
+void enqueue_commands(const vector<Command> &batch);
+
+/**
+ * parse_command reads the next command, such as "insert(80)", starting at p and stopping at end. Commands are separated
+ * by " || " and may span several lines. It advances p past the command and fills in c.
+ * Returns false once there are no more commands.
+ * */
+bool parse_command(const char *&p, const char *end, Command &c);
+
+/**
+ * parse_policy sets policy to the RWPolicy named in name, ignoring blank space around it.
+ * Returns 1 if no policy has that name.
+ * */
+int parse_policy(const string &name, RWPolicy &policy);
+
+/**
+ * read_file parses the input file for the tree nodes, thread information, and function calls.
+ * The file is memory mapped and the commands are scanned in place and handed to the threads in batches,
+ * so the threads work while the rest of the file is still being parsed.
+ * Returns 1 if an error occurs while opening or reading the file.
+ * */
+int read_file(char *filename);
+
+/**
+ * write_file prints the specified output to an output file "out.txt". It prints the execution time, the results of the
+ * function calls and which thread ran them, as well as the final red black tree, which can instead be written to its
+ * own file or skipped.
+ * */
+void write_file(RBtree<int> *t);
+
+/**
+ * format_result appends the result r to line as it is written in out.txt, such as "search(80)->true". keys points to
+ * the keys found by a range command.
+ * */
+void format_result(string &line, const Result &r, const int *keys);
+
+/**
+ * print_result prints the result r, from the log of its thread, as a line of out.txt.
+ * */
+void print_result(ofstream &out, const Result &r);
+
+/**
+ * serve keeps the tree and the threads running and answers the commands that clients send to the Unix domain socket
+ * at path, or that come in on the standard input when path is "-", until a client sends "shutdown" or the standard
+ * input ends. Each line is a request of commands separated by " || ", and a client may send more requests before the
+ * answers come back. The answer to a request is the result of each of its commands, one per line, followed by an empty
+ * line; requests are answered in order and answers that are ready together are sent together. The requests of a client
+ * also run in order: a request that modifies the tree starts once the earlier requests of the client have finished,
+ * and any other request once the earlier ones that modify the tree have. The commands of one request run concurrently.
+ * Returns 1 if the socket cannot be set up.
+ * */
+int serve(const char *path);
+
+/**
+ * serve_connection reads the requests of the client conn, hands their commands to the threads and sends back the
+ * answers until the client is done or the server shuts down. A request is handed over once the earlier requests it
+ * could see or change have finished. It sets shutdown_requested when the client sends "shutdown".
+ * */
+void serve_connection(Connection *conn);
+
+/**
+ * respond sends the answers to the requests of conn, in order, as they finish, until conn is closed and every answer
+ * has been sent.
+ * */
+void respond(Connection *conn);
+
+/**
+ * write_results prints the results of every thread to out in the order they were produced, merging the logs of the
+ * threads by time. Results with the same time keep the order of their log, and the logs are taken by thread id.
+ * */
+void write_results(ofstream &out);
+
+/**
+ * create_tree builds the tree from the nodes as listed on the first line of the input file: comma separated keys
+ * followed by their color in preorder, with "f" for every nil leaf. It takes in a pointer to the characters of the
+ * line and their count and adds the nodes in a single pass, keeping the nodes whose children are still missing on an
+ * explicit stack instead of recursing. Returns a pointer to the tree.
+ * */
+RBtree<int> * create_tree(const char *line, size_t len);
+
+/**
+ * create_sorted_helper is a recursive function that links the keys between lo and hi of the sorted vector keys into a
+ * balanced subtree whose root is at the given depth. Nodes at red_depth are colored red and all others black.
+ * It returns a pointer to the root of the subtree.
+ * */
+template <class Key, class Value, class Compare>
+typename RBtree<Key, Value, Compare>::Node * create_sorted_helper(RBtree<Key, Value, Compare> *t, const vector<Key> &keys, long lo, long hi, int depth, int red_depth) {
+    if (lo > hi) {
+        return t->nil;
+    }
+    long mid = lo + (hi - lo) / 2;
+    typename RBtree<Key, Value, Compare>::Node *temp = t->pool.allocate();
+    temp->key = keys[mid];
+    temp->color = depth == red_depth;
+    temp->size = hi - lo + 1;
+    temp->left = create_sorted_helper(t, keys, lo, mid - 1, depth + 1, red_depth);
+    temp->right = create_sorted_helper(t, keys, mid + 1, hi, depth + 1, red_depth);
+    if (temp->left != t->nil) {
+        temp->left->parent = temp;
+    }
+    if (temp->right != t->nil) {
+        temp->right->parent = temp;
+    }
+    return temp;
+}
+
+/**
+ * create_tree_sorted takes in a vector of keys in ascending order and builds a balanced, correctly colored red black tree
+ * holding them in linear time, augmented if asked to. Returns a pointer to the tree.
+ * */
+template <class Key, class Value = Empty, class Compare = less<Key> >
+RBtree<Key, Value, Compare> * create_tree_sorted(const vector<Key> &keys, bool augmented = false) {
+    RBtree<Key, Value, Compare> *tree = new RBtree<Key, Value, Compare>(augmented);
+    if (keys.empty()) {
+        return tree;
+    }
+    //splitting at the middle puts every nil leaf on the last two levels, so the nodes on the deepest level
+    //can be red while every other node is black
+    int red_depth = 0;
+    while ((2UL << red_depth) <= keys.size()) {
+        red_depth++;
+    }
+    if (red_depth == 0) {
+        red_depth = -1;
+    }
+    tree->root = create_sorted_helper(tree, keys, 0, (long) keys.size() - 1, 0, red_depth);
+    tree->root->parent = tree->nil;
+    return tree;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,378 @@
+/**
+ * sharded_rbtree.h defines ShardedRBtree, a front-end that splits the key space into ranges and keeps each range in its
+ * own RBtree with its own lock. Searches and modifications lock only the shard that owns their key, so modifications
+ * of different shards run in parallel. Queries over several shards lock them shared in ascending order, which gives
+ * them a consistent view and cannot deadlock with the single-shard modifications.
+ **/
+#include "rbtree.h"
+#include <vector>
+#include <algorithm>
+
+#ifndef SHARDED_RBTREE_H_
+#define SHARDED_RBTREE_H_
+
+using namespace std;
+
+/**
+ * The ShardedRBtree class partitions the keys of a tree across independent RBtree shards by key range.
+ * Shard i holds the keys that are not smaller than bounds[i - 1] and smaller than bounds[i].
+ * */
+template <class Key, class Value = Empty, class Compare = less<Key> >
+class ShardedRBtree {
+    public:
+    typedef RBtree<Key, Value, Compare> Tree;
+    typedef typename Tree::Node Node;
+    /**
+     * The Shard struct is one key range: its tree and the lock that guards it.
+     * */
+    struct Shard {
+        Tree *tree;
+        RWlock lock;
+        Shard(Tree *t) : tree(t) {}
+        ~Shard() {
+            delete tree;
+        }
+    };
+    /**
+     * shards holds the shards in key order.
+     * */
+    vector<Shard *> shards;
+    /**
+     * bounds holds the smallest key of every shard but the first.
+     * */
+    vector<Key> bounds;
+    /**
+     * comp orders the keys.
+     * */
+    Compare comp;
+    /**
+     * shard_of returns the index of the shard that owns the key num.
+     * */
+    int shard_of(const Key &num) {
+        return upper_bound(bounds.begin(), bounds.end(), num, comp) - bounds.begin();
+    }
+    /**
+     * search returns true if the input key is present in the tree and false if it is not.
+     * */
+    bool search(const Key &num);
+    /**
+     * search_optimistic is search without the shard lock, validated against the version counter of the shard's tree.
+     * */
+    bool search_optimistic(const Key &num);
+    /**
+     * insert inserts the key num, mapped to value, into the shard that owns it.
+     * */
+    void insert(const Key &num, const Value &value = Value());
+    /**
+     * delete_node removes the node with the key num from the shard that owns it, if it exists.
+     * */
+    void delete_node(const Key &num);
+    /**
+     * modify calls f with the tree of the shard that owns the key num while holding the shard's lock, so whatever f
+     * does along with the modification is ordered like the modifications of that key.
+     * */
+    template <class F>
+    void modify(const Key &num, F f);
+    /**
+     * size returns the number of keys in all the shards.
+     * */
+    int size();
+    /**
+     * rank returns the number of keys smaller than num.
+     * */
+    int rank(const Key &num);
+    /**
+     * select sets key to the k-th smallest key, counting from 1. Returns false if there are fewer than k keys.
+     * */
+    bool select(int k, Key &key);
+    /**
+     * range_count returns the number of keys between lo and hi, both included.
+     * */
+    int range_count(const Key &lo, const Key &hi);
+    /**
+     * scan calls f on every node with a key between lo and hi, both included, in key order, stitching the shards
+     * together. Every shard the range touches is held shared for the whole scan.
+     * */
+    template <class F>
+    void scan(const Key &lo, const Key &hi, F f);
+    /**
+     * merge builds a single balanced tree holding every key and value of the shards, in linear time, and adds the
+     * counters of the shards to its stats. It must not run alongside other operations. Returns a pointer to the tree.
+     * */
+    Tree * merge();
+    /**
+     * Constructor for the ShardedRBtree class. It splits the keys of t into k shards, using as bounds the keys at the
+     * quantiles of the keys of t together with the keys in sample, such as keys that are about to be inserted, and
+     * leaves t untouched. Equal keys stay in one shard, and fewer than k distinct keys give fewer shards. The shards
+     * are augmented if t is, which rank, select and range_count need.
+     * */
+    ShardedRBtree(Tree *t, int k, const vector<Key> &sample = vector<Key>());
+    /**
+     * Destructor for the ShardedRBtree class. Frees every shard.
+     * */
+    ~ShardedRBtree();
+    ShardedRBtree(const ShardedRBtree &) = delete;
+    ShardedRBtree & operator=(const ShardedRBtree &) = delete;
+
+    private:
+    void lock_shared(int first, int last);
+    void unlock_shared(int first, int last);
+};
+
+/**
+ * lock_shared takes the locks of the shards first to last, in that order, shared.
+ * */
+template <class Key, class Value, class Compare>
+void ShardedRBtree<Key, Value, Compare>::lock_shared(int first, int last) {
+    for (int i=first; i<=last; i++) {
+        shards[i]->lock.lock_shared();
+    }
+}
+
+/**
+ * unlock_shared releases the shared locks of the shards first to last.
+ * */
+template <class Key, class Value, class Compare>
+void ShardedRBtree<Key, Value, Compare>::unlock_shared(int first, int last) {
+    for (int i=last; i>=first; i--) {
+        shards[i]->lock.unlock_shared();
+    }
+}
+
+/**
+ * search returns true if the input key is present in the tree and false if it is not.
+ * */
+template <class Key, class Value, class Compare>
+bool ShardedRBtree<Key, Value, Compare>::search(const Key &num) {
+    Shard *s = shards[shard_of(num)];
+    s->lock.lock_shared();
+    bool found = s->tree->search(num);
+    s->lock.unlock_shared();
+    return found;
+}
+
+/**
+ * search_optimistic is search without the shard lock, validated against the version counter of the shard's tree.
+ * */
+template <class Key, class Value, class Compare>
+bool ShardedRBtree<Key, Value, Compare>::search_optimistic(const Key &num) {
+    return shards[shard_of(num)]->tree->search_optimistic(num);
+}
+
+/**
+ * insert inserts the key num, mapped to value, into the shard that owns it.
+ * */
+template <class Key, class Value, class Compare>
+void ShardedRBtree<Key, Value, Compare>::insert(const Key &num, const Value &value) {
+    Shard *s = shards[shard_of(num)];
+    s->lock.lock();
+    s->tree->insert(num, value);
+    s->lock.unlock();
+}
+
+/**
+ * delete_node removes the node with the key num from the shard that owns it, if it exists.
+ * */
+template <class Key, class Value, class Compare>
+void ShardedRBtree<Key, Value, Compare>::delete_node(const Key &num) {
+    Shard *s = shards[shard_of(num)];
+    s->lock.lock();
+    s->tree->delete_node(num);
+    s->lock.unlock();
+}
+
+/**
+ * modify calls f with the tree of the shard that owns the key num while holding the shard's lock, so whatever f
+ * does along with the modification is ordered like the modifications of that key.
+ * */
+template <class Key, class Value, class Compare>
+template <class F>
+void ShardedRBtree<Key, Value, Compare>::modify(const Key &num, F f) {
+    Shard *s = shards[shard_of(num)];
+    s->lock.lock();
+    f(s->tree);
+    s->lock.unlock();
+}
+
+/**
+ * size returns the number of keys in all the shards.
+ * */
+template <class Key, class Value, class Compare>
+int ShardedRBtree<Key, Value, Compare>::size() {
+    int last = shards.size() - 1;
+    int count = 0;
+    lock_shared(0, last);
+    for (int i=0; i<=last; i++) {
+        count += shards[i]->tree->size();
+    }
+    unlock_shared(0, last);
+    return count;
+}
+
+/**
+ * rank returns the number of keys smaller than num.
+ * */
+template <class Key, class Value, class Compare>
+int ShardedRBtree<Key, Value, Compare>::rank(const Key &num) {
+    int last = shard_of(num);
+    int count = 0;
+    lock_shared(0, last);
+    //every key of an earlier shard is smaller
+    for (int i=0; i<last; i++) {
+        count += shards[i]->tree->size();
+    }
+    count += shards[last]->tree->rank(num);
+    unlock_shared(0, last);
+    return count;
+}
+
+/**
+ * select sets key to the k-th smallest key, counting from 1. Returns false if there are fewer than k keys.
+ * */
+template <class Key, class Value, class Compare>
+bool ShardedRBtree<Key, Value, Compare>::select(int k, Key &key) {
+    int last = shards.size() - 1;
+    bool found = false;
+    lock_shared(0, last);
+    for (int i=0; i<=last && k >= 1; i++) {
+        Tree *t = shards[i]->tree;
+        if (k <= t->size()) {
+            key = t->select(k)->key;
+            found = true;
+            break;
+        }
+        k -= t->size();
+    }
+    unlock_shared(0, last);
+    return found;
+}
+
+/**
+ * range_count returns the number of keys between lo and hi, both included.
+ * */
+template <class Key, class Value, class Compare>
+int ShardedRBtree<Key, Value, Compare>::range_count(const Key &lo, const Key &hi) {
+    if (comp(hi, lo)) {
+        return 0;
+    }
+    int first = shard_of(lo);
+    int last = shard_of(hi);
+    int count = 0;
+    lock_shared(first, last);
+    for (int i=first; i<=last; i++) {
+        count += shards[i]->tree->range_count(lo, hi);
+    }
+    unlock_shared(first, last);
+    return count;
+}
+
+/**
+ * scan calls f on every node with a key between lo and hi, both included, in key order, stitching the shards
+ * together. Every shard the range touches is held shared for the whole scan.
+ * */
+template <class Key, class Value, class Compare>
+template <class F>
+void ShardedRBtree<Key, Value, Compare>::scan(const Key &lo, const Key &hi, F f) {
+    if (comp(hi, lo)) {
+        return;
+    }
+    int first = shard_of(lo);
+    int last = shard_of(hi);
+    lock_shared(first, last);
+    for (int i=first; i<=last; i++) {
+        Tree *t = shards[i]->tree;
+        for (typename Tree::iterator it = t->lower_bound(lo); it != t->end() && !comp(hi, *it); ++it) {
+            f(it.node);
+        }
+    }
+    unlock_shared(first, last);
+}
+
+/**
+ * merge builds a single balanced tree holding every key and value of the shards, in linear time, and adds the
+ * counters of the shards to its stats. It must not run alongside other operations. Returns a pointer to the tree.
+ * */
+template <class Key, class Value, class Compare>
+typename ShardedRBtree<Key, Value, Compare>::Tree * ShardedRBtree<Key, Value, Compare>::merge() {
+    vector<Key> keys;
+    vector<Value> values;
+    for (size_t i=0; i<shards.size(); i++) {
+        Tree *t = shards[i]->tree;
+        for (typename Tree::iterator it = t->begin(); it != t->end(); ++it) {
+            keys.push_back(*it);
+            values.push_back(it.node->get_value());
+        }
+    }
+    Tree *merged = create_tree_sorted<Key, Value, Compare>(keys, shards[0]->tree->augmented);
+    size_t j = 0;
+    for (typename Tree::iterator it = merged->begin(); it != merged->end(); ++it) {
+        it.node->set_value(values[j++]);
+    }
+    for (size_t i=0; i<shards.size(); i++) {
+        merged->stats.rotations += shards[i]->tree->stats.rotations;
+        merged->stats.insert_fixup_iterations += shards[i]->tree->stats.insert_fixup_iterations;
+        merged->stats.delete_fixup_iterations += shards[i]->tree->stats.delete_fixup_iterations;
+    }
+    return merged;
+}
+
+/**
+ * Constructor for the ShardedRBtree class. It splits the keys of t into k shards, using as bounds the keys at the
+ * quantiles of the keys of t together with the keys in sample, such as keys that are about to be inserted, and
+ * leaves t untouched. Equal keys stay in one shard, and fewer than k distinct keys give fewer shards. The shards
+ * are augmented if t is, which rank, select and range_count need.
+ * */
+template <class Key, class Value, class Compare>
+ShardedRBtree<Key, Value, Compare>::ShardedRBtree(Tree *t, int k, const vector<Key> &sample) {
+    vector<Node *> nodes;
+    nodes.reserve(t->size());
+    for (typename Tree::iterator it = t->begin(); it != t->end(); ++it) {
+        nodes.push_back(it.node);
+    }
+    size_t n = nodes.size();
+    vector<Key> all(sample);
+    sort(all.begin(), all.end(), comp);
+    all.reserve(n + sample.size());
+    for (size_t i=0; i<n; i++) {
+        all.push_back(nodes[i]->key);
+    }
+    inplace_merge(all.begin(), all.begin() + sample.size(), all.end(), comp);
+    //a key equal to a bound goes to the shard after it, so bounds that repeat or equal the smallest key are dropped
+    for (int i=1; i<k && !all.empty(); i++) {
+        const Key &b = all[all.size() * i / k];
+        if (comp(all[0], b) && (bounds.empty() || comp(bounds.back(), b))) {
+            bounds.push_back(b);
+        }
+    }
+    size_t lo = 0;
+    for (size_t i=0; i<=bounds.size(); i++) {
+        size_t hi = lo;
+        while (hi < n && (i == bounds.size() || comp(nodes[hi]->key, bounds[i]))) {
+            hi++;
+        }
+        vector<Key> keys;
+        keys.reserve(hi - lo);
+        for (size_t j=lo; j<hi; j++) {
+            keys.push_back(nodes[j]->key);
+        }
+        Tree *shard = create_tree_sorted<Key, Value, Compare>(keys, t->augmented);
+        size_t j = lo;
+        for (typename Tree::iterator it = shard->begin(); it != shard->end(); ++it) {
+            it.node->set_value(nodes[j++]->get_value());
+        }
+        shards.push_back(new Shard(shard));
+        lo = hi;
+    }
+}
+
+/**
+ * Destructor for the ShardedRBtree class. Frees every shard.
+ * */
+template <class Key, class Value, class Compare>
+ShardedRBtree<Key, Value, Compare>::~ShardedRBtree() {
+    for (size_t i=0; i<shards.size(); i++) {
+        delete shards[i];
+    }
+}
+
+#endif
@@ -0,0 +1,606 @@
+/**
+ * wal.h defines WriteAheadLog, an append-only log of the inserts and deletes applied to a tree, so that the tree can
+ * be rebuilt after a crash from its latest snapshot and the log written since.
+ *
+ * Appending a record only copies it into a buffer in memory. A thread of the log writes the buffer out and syncs it to
+ * disk once it holds a whole group of records or the oldest record in it has waited for the group interval, so one
+ * sync covers many modifications (group commit) and the threads applying them do not wait for the disk, unless it
+ * falls two groups behind. Records that piled up while a sync ran are written as several groups of at most the group
+ * size, each with its record count and a checksum, so a group torn by a crash is recognized and dropped on replay. A
+ * group that fails to be written or synced is cut off the log and written again, and if that keeps failing the
+ * program exits rather than confirm modifications that are not on disk.
+ *
+ * Compaction saves a snapshot of the tree and starts a new, empty log. Snapshots and logs carry a generation number:
+ * the log of generation g goes with the snapshot "path.g.snap" (generation 0 has none and goes with the tree the
+ * program starts from). The new snapshot and its directory entry are on disk before the new log replaces the old
+ * one, and the old snapshot is only removed once the new log's entry is on disk too, so a crash at any point leaves a
+ * matching pair.
+ **/
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifndef WAL_H_
+#define WAL_H_
+
+using namespace std;
+
+/**
+ * LOG_VERSION is the version of the log format written by WriteAheadLog.
+ * */
+#define LOG_VERSION 1
+
+/**
+ * LOG_COMPACT_MIN is the number of records a log holds at least before it is compacted. Beyond it, a log is compacted
+ * once it holds more records than its snapshot has keys, so the cost of the snapshots stays proportional to the work.
+ * */
+#define LOG_COMPACT_MIN (1 << 20)
+
+/**
+ * LOG_WRITE_RETRIES is the number of times a group that could not be written or synced is written again before the
+ * program gives up.
+ * */
+#define LOG_WRITE_RETRIES 3
+
+/**
+ * The operations a log record can hold.
+ * */
+enum LogOp : uint8_t {LOG_INSERT, LOG_DELETE};
+
+/**
+ * The LogRecord struct is one modification: an insert or delete of key.
+ * */
+template <class Key>
+struct LogRecord {
+    LogOp op;
+    Key key;
+};
+
+/**
+ * The LogHeader struct starts every log file. It is followed by groups of records, each a LogGroupHeader and then
+ * count records of one operation byte and the bytes of the key.
+ * */
+struct LogHeader {
+    //always "RBL" followed by a zero byte
+    char magic[4];
+    //LOG_VERSION of the writer
+    uint32_t version;
+    //size in bytes of each key
+    uint32_t key_size;
+    uint32_t reserved;
+    //the log goes on top of the snapshot of this generation
+    uint64_t generation;
+};
+
+/**
+ * The LogGroupHeader struct starts every group of at most the group size records.
+ * */
+struct LogGroupHeader {
+    //number of records in the group
+    uint32_t count;
+    //checksum of the count and the records
+    uint32_t checksum;
+};
+
+/**
+ * The WriteAheadLog class appends the modifications of a tree to the log file path and compacts it into snapshots.
+ * Appends may come from any thread, but the caller orders them: two modifications of the same key must be appended
+ * in the order they were applied.
+ * */
+template <class Key>
+class WriteAheadLog {
+    public:
+    /**
+     * Constructor for the WriteAheadLog class. The log is synced once group_size records are waiting or the oldest of
+     * them has waited interval_us microseconds.
+     * */
+    WriteAheadLog(const string &path, size_t group_size, unsigned long interval_us);
+    /**
+     * Destructor for the WriteAheadLog class. Syncs the records still waiting and closes the log.
+     * */
+    ~WriteAheadLog();
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog & operator=(const WriteAheadLog &) = delete;
+    /**
+     * open_log reads the header of the log file, creating an empty log of generation 0 if there is none.
+     * Returns 1 if the file cannot be created or is not a log of this key type.
+     * */
+    int open_log();
+    /**
+     * snapshot_path returns the snapshot the log goes on top of, or an empty string if the tree starts from scratch.
+     * */
+    string snapshot_path();
+    /**
+     * replay applies every intact record of the log to t, drops a torn group at its end and starts syncing appends.
+     * Returns 1 if the log cannot be read.
+     * */
+    template <class Tree>
+    int replay(Tree *t);
+    /**
+     * empty returns true if the log has neither a snapshot nor records, that is if no modification ever reached it.
+     * */
+    bool empty();
+    /**
+     * append adds the n records to the log and returns the number of records appended so far, which wait_durable
+     * takes. The records are on disk once a later sync has finished. It waits while two groups are already waiting.
+     * */
+    unsigned long append(const LogRecord<Key> *records, size_t n);
+    /**
+     * appended returns the number of records appended so far.
+     * */
+    unsigned long appended();
+    /**
+     * wait_durable waits until the first count records appended are on disk.
+     * */
+    void wait_durable(unsigned long count);
+    /**
+     * should_compact returns true if the log has grown enough to be compacted and no other thread is compacting it.
+     * The caller then has to call compact.
+     * */
+    bool should_compact();
+    /**
+     * compact saves t as the snapshot of the next generation and starts its empty log. t must hold exactly the
+     * modifications appended so far, and nothing may be appended until compact returns.
+     * Returns 1 if an error occurs while writing the files. The current log stays in use unless the new one was
+     * already in its place, and the snapshot of the current log is kept either way.
+     * */
+    template <class Tree>
+    int compact(Tree *t);
+
+    private:
+    string path;
+    size_t group_size;
+    chrono::microseconds interval;
+    int fd;
+    //the end of the last group that is on disk, where the next one goes
+    off_t end_offset;
+    uint64_t generation;
+    mutex lock;
+    //signalled when a group is ready to be written, and when the log closes
+    condition_variable group_ready;
+    //signalled when a sync has finished
+    condition_variable synced;
+    //signalled when the syncer takes the buffered records
+    condition_variable drained;
+    //the records waiting to be written
+    vector<char> buffer;
+    size_t buffered;
+    chrono::steady_clock::time_point oldest;
+    //records appended so far, and those of them that are on disk
+    unsigned long appended_count;
+    unsigned long durable_count;
+    //a group is being written out
+    bool writing;
+    //the buffered records are to be written out without waiting for the group to fill
+    bool flushing;
+    bool closing;
+    //records in the log since the last compaction, and keys of the last snapshot
+    unsigned long log_records;
+    unsigned long snapshot_keys;
+    atomic<bool> compacting;
+    thread syncer;
+
+    static const size_t record_size = 1 + sizeof(Key);
+    static uint32_t checksum(const char *p, size_t len, uint32_t count);
+    string generation_path(uint64_t g);
+    void sync_groups();
+    int write_groups(const vector<char> &records, size_t count, vector<char> &out);
+    int write_header(int out, uint64_t g);
+    static int sync_dir(const string &file);
+};
+
+/**
+ * Constructor for the WriteAheadLog class. The log is synced once group_size records are waiting or the oldest of
+ * them has waited interval_us microseconds.
+ * */
+template <class Key>
+WriteAheadLog<Key>::WriteAheadLog(const string &path, size_t group_size, unsigned long interval_us)
+    : path(path), group_size(group_size > 0 ? group_size : 1), interval(interval_us), fd(-1), end_offset(0), generation(0),
+      buffered(0), appended_count(0), durable_count(0), writing(false), flushing(false),
+      closing(false), log_records(0), snapshot_keys(0), compacting(false) {
+    static_assert(is_trivially_copyable<Key>::value, "logs store the raw bytes of the keys");
+}
+
+/**
+ * Destructor for the WriteAheadLog class. Syncs the records still waiting and closes the log.
+ * */
+template <class Key>
+WriteAheadLog<Key>::~WriteAheadLog() {
+    if (syncer.joinable()) {
+        lock.lock();
+        closing = true;
+        lock.unlock();
+        group_ready.notify_one();
+        drained.notify_all();
+        syncer.join();
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/**
+ * checksum returns the FNV-1a hash of the record count and the len bytes at p.
+ * */
+template <class Key>
+uint32_t WriteAheadLog<Key>::checksum(const char *p, size_t len, uint32_t count) {
+    uint32_t h = 2166136261u;
+    for (int i=0; i<4; i++) {
+        h = (h ^ ((count >> (8 * i)) & 0xff)) * 16777619u;
+    }
+    for (size_t i=0; i<len; i++) {
+        h = (h ^ (uint8_t) p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * generation_path returns the name of the snapshot of generation g.
+ * */
+template <class Key>
+string WriteAheadLog<Key>::generation_path(uint64_t g) {
+    return path + "." + to_string(g) + ".snap";
+}
+
+/**
+ * write_header writes the header of an empty log of generation g to out and syncs it. Returns 1 if it fails.
+ * */
+template <class Key>
+int WriteAheadLog<Key>::write_header(int out, uint64_t g) {
+    LogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "RBL", 4);
+    header.version = LOG_VERSION;
+    header.key_size = sizeof(Key);
+    header.generation = g;
+    return write(out, &header, sizeof(header)) != (ssize_t) sizeof(header) || fdatasync(out) != 0;
+}
+
+/**
+ * sync_dir syncs the directory holding file, so that a file created or renamed in it stays after a crash.
+ * Returns 1 if it fails.
+ * */
+template <class Key>
+int WriteAheadLog<Key>::sync_dir(const string &file) {
+    size_t slash = file.rfind('/');
+    string dir = slash == string::npos ? "." : (slash == 0 ? "/" : file.substr(0, slash));
+    int d = open(dir.c_str(), O_RDONLY);
+    if (d < 0) {
+        return 1;
+    }
+    int failed = fsync(d) != 0;
+    close(d);
+    return failed;
+}
+
+/**
+ * open_log reads the header of the log file, creating an empty log of generation 0 if there is none.
+ * Returns 1 if the file cannot be created or is not a log of this key type.
+ * */
+template <class Key>
+int WriteAheadLog<Key>::open_log() {
+    fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        //a new log starts as a complete file, so a crash never leaves one without its header
+        string tmp = path + ".tmp";
+        int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            return 1;
+        }
+        if (write_header(out, 0) || rename(tmp.c_str(), path.c_str()) != 0 || sync_dir(path)) {
+            close(out);
+            return 1;
+        }
+        close(out);
+        fd = open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            return 1;
+        }
+    }
+    LogHeader header;
+    if (read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) || memcmp(header.magic, "RBL", 4) != 0
+        || header.version != LOG_VERSION || header.key_size != sizeof(Key)) {
+        return 1;
+    }
+    generation = header.generation;
+    return 0;
+}
+
+/**
+ * snapshot_path returns the snapshot the log goes on top of, or an empty string if the tree starts from scratch.
+ * */
+template <class Key>
+string WriteAheadLog<Key>::snapshot_path() {
+    return generation == 0 ? string() : generation_path(generation);
+}
+
+/**
+ * replay applies every intact record of the log to t, drops a torn group at its end and starts syncing appends.
+ * Returns 1 if the log cannot be read.
+ * */
+template <class Key>
+template <class Tree>
+int WriteAheadLog<Key>::replay(Tree *t) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return 1;
+    }
+    //the log is mapped rather than read, so pages are brought in as the records are applied and can be dropped again
+    size_t len = st.st_size - sizeof(LogHeader);
+    void *map = NULL;
+    if (len > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            return 1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    const char *data = (const char *) map + sizeof(LogHeader);
+    size_t pos = 0;
+    while (pos + sizeof(LogGroupHeader) <= len) {
+        LogGroupHeader group;
+        memcpy(&group, data + pos, sizeof(group));
+        const char *records = data + pos + sizeof(group);
+        size_t group_len = (size_t) group.count * record_size;
+        //a group cut short or garbled by a crash ends the log
+        if (group_len > len - pos - sizeof(group) || checksum(records, group_len, group.count) != group.checksum) {
+            break;
+        }
+        for (uint32_t i=0; i<group.count; i++) {
+            Key key;
+            memcpy(&key, records + i * record_size + 1, sizeof(Key));
+            if (records[i * record_size] == LOG_INSERT) {
+                t->insert(key);
+            } else {
+                t->delete_node(key);
+            }
+        }
+        log_records += group.count;
+        pos += sizeof(group) + group_len;
+    }
+    if (map != NULL) {
+        munmap(map, st.st_size);
+    }
+    //new groups go right after the last intact one
+    if (pos < len && (ftruncate(fd, sizeof(LogHeader) + pos) != 0 || fdatasync(fd) != 0)) {
+        return 1;
+    }
+    end_offset = sizeof(LogHeader) + pos;
+    snapshot_keys = t->size();
+    syncer = thread(&WriteAheadLog::sync_groups, this);
+    return 0;
+}
+
+/**
+ * append adds the n records to the log and returns the number of records appended so far, which wait_durable
+ * takes. The records are on disk once a later sync has finished. It waits while two groups are already waiting.
+ * */
+template <class Key>
+unsigned long WriteAheadLog<Key>::append(const LogRecord<Key> *records, size_t n) {
+    unique_lock<mutex> lk(lock);
+    //the disk is behind; what a crash can lose stays bounded
+    while (buffered >= 2 * group_size && !closing) {
+        drained.wait(lk);
+    }
+    if (buffered == 0) {
+        oldest = chrono::steady_clock::now();
+    }
+    size_t end = buffer.size();
+    buffer.resize(end + n * record_size);
+    char *p = buffer.data() + end;
+    for (size_t i=0; i<n; i++) {
+        p[0] = records[i].op;
+        memcpy(p + 1, &records[i].key, sizeof(Key));
+        p += record_size;
+    }
+    //the syncer only needs waking to time a new group and when the group fills up
+    if (buffered == 0 || (buffered < group_size && buffered + n >= group_size)) {
+        group_ready.notify_one();
+    }
+    buffered += n;
+    appended_count += n;
+    log_records += n;
+    return appended_count;
+}
+
+/**
+ * empty returns true if the log has neither a snapshot nor records, that is if no modification ever reached it.
+ * */
+template <class Key>
+bool WriteAheadLog<Key>::empty() {
+    lock_guard<mutex> lk(lock);
+    return generation == 0 && log_records == 0;
+}
+
+/**
+ * appended returns the number of records appended so far.
+ * */
+template <class Key>
+unsigned long WriteAheadLog<Key>::appended() {
+    lock_guard<mutex> lk(lock);
+    return appended_count;
+}
+
+/**
+ * wait_durable waits until the first count records appended are on disk.
+ * */
+template <class Key>
+void WriteAheadLog<Key>::wait_durable(unsigned long count) {
+    unique_lock<mutex> lk(lock);
+    while (durable_count < count && !closing) {
+        synced.wait(lk);
+    }
+}
+
+/**
+ * write_groups lays out the count records as groups of at most group_size records in out, writes them after the last
+ * group on disk and syncs them. If either fails, the log is cut back to where it ended, so no torn group is left in
+ * front of the groups written after it.
+ * Returns 1 if the groups are not on disk.
+ * */
+template <class Key>
+int WriteAheadLog<Key>::write_groups(const vector<char> &records, size_t count, vector<char> &out) {
+    out.clear();
+    for (size_t first=0; first<count; first+=group_size) {
+        size_t n = min(group_size, count - first);
+        const char *p = records.data() + first * record_size;
+        LogGroupHeader header = {(uint32_t) n, checksum(p, n * record_size, n)};
+        out.insert(out.end(), (const char *) &header, (const char *) (&header + 1));
+        out.insert(out.end(), p, p + n * record_size);
+    }
+    size_t sent = 0;
+    while (sent < out.size()) {
+        ssize_t n = pwrite(fd, out.data() + sent, out.size() - sent, end_offset + sent);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    if (sent < out.size() || fdatasync(fd) != 0) {
+        perror("write-ahead log");
+        if (ftruncate(fd, end_offset) != 0) {
+            perror("write-ahead log");
+        }
+        return 1;
+    }
+    end_offset += out.size();
+    return 0;
+}
+
+/**
+ * sync_groups is the function the thread of the log runs in. It writes out and syncs the buffered records whenever a
+ * group is full or its oldest record has waited for the interval, until the log closes.
+ * */
+template <class Key>
+void WriteAheadLog<Key>::sync_groups() {
+    vector<char> records;
+    vector<char> out;
+    unique_lock<mutex> lk(lock);
+    while (true) {
+        if (buffered == 0) {
+            if (closing) {
+                break;
+            }
+            group_ready.wait(lk);
+            continue;
+        }
+        if (!closing && !flushing && buffered < group_size && chrono::steady_clock::now() < oldest + interval) {
+            group_ready.wait_until(lk, oldest + interval);
+            continue;
+        }
+        //appends go on into the other buffer while these records are written
+        records.swap(buffer);
+        buffer.clear();
+        size_t count = buffered;
+        unsigned long upto = appended_count;
+        buffered = 0;
+        writing = true;
+        drained.notify_all();
+        lk.unlock();
+        int failed = write_groups(records, count, out);
+        for (int i=0; failed && i<LOG_WRITE_RETRIES; i++) {
+            this_thread::sleep_for(interval);
+            failed = write_groups(records, count, out);
+        }
+        if (failed) {
+            //records that cannot be made durable must not be confirmed, so nothing more is
+            fprintf(stderr, "write-ahead log: giving up after %d retries\n", LOG_WRITE_RETRIES);
+            _exit(1);
+        }
+        lk.lock();
+        writing = false;
+        durable_count = upto;
+        synced.notify_all();
+    }
+    synced.notify_all();
+}
+
+/**
+ * should_compact returns true if the log has grown enough to be compacted and no other thread is compacting it.
+ * The caller then has to call compact.
+ * */
+template <class Key>
+bool WriteAheadLog<Key>::should_compact() {
+    {
+        lock_guard<mutex> lk(lock);
+        if (log_records < LOG_COMPACT_MIN || log_records < snapshot_keys) {
+            return false;
+        }
+    }
+    return !compacting.exchange(true);
+}
+
+/**
+ * compact saves t as the snapshot of the next generation and starts its empty log. t must hold exactly the
+ * modifications appended so far, and nothing may be appended until compact returns.
+ * Returns 1 if an error occurs while writing the files. The current log stays in use unless the new one was
+ * already in its place, and the snapshot of the current log is kept either way.
+ * */
+template <class Key>
+template <class Tree>
+int WriteAheadLog<Key>::compact(Tree *t) {
+    compacting = true;
+    //every record goes into the old log before it is replaced
+    {
+        unique_lock<mutex> lk(lock);
+        flushing = true;
+        group_ready.notify_one();
+        while (buffered > 0 || writing) {
+            synced.wait(lk);
+        }
+        flushing = false;
+    }
+    //the snapshot has to be complete on disk before the log that needs it
+    uint64_t next = generation + 1;
+    string snap = generation_path(next);
+    string tmp = snap + ".tmp";
+    int failed = t->save(tmp.c_str());
+    int out = failed ? -1 : open(tmp.c_str(), O_RDONLY);
+    if (out < 0 || fsync(out) != 0 || rename(tmp.c_str(), snap.c_str()) != 0 || sync_dir(snap)) {
+        failed = 1;
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    //then the empty log of the new generation takes the place of the old one in one rename
+    string log_tmp = path + ".tmp";
+    out = failed ? -1 : open(log_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0 || write_header(out, next) || rename(log_tmp.c_str(), path.c_str()) != 0) {
+        if (out >= 0) {
+            close(out);
+        }
+        unlink(tmp.c_str());
+        unlink(log_tmp.c_str());
+        compacting = false;
+        return 1;
+    }
+    lock.lock();
+    close(fd);
+    fd = out;
+    end_offset = sizeof(LogHeader);
+    log_records = 0;
+    snapshot_keys = t->size();
+    lock.unlock();
+    //the new log has replaced the old one, but until that is on disk a crash can bring back the old pair
+    uint64_t previous = generation;
+    generation = next;
+    failed = sync_dir(path);
+    if (!failed && previous > 0) {
+        unlink(generation_path(previous).c_str());
+    }
+    compacting = false;
+    return failed;
+}
+
+#endif